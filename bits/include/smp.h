@@ -49,6 +49,25 @@ const CPU_INFO *smp_read_cpu_list(void);
 
 U32 smp_function(U32 apicid, CALLBACK function, void *param);
 
+/* Run function on several CPUs concurrently; see smprc.h for the param layout. */
+U32 smp_function_multicast(const U32 *apicids, U32 count, CALLBACK function, void *param, U32 param_stride);
+U32 smp_function_broadcast(CALLBACK function, void *param, U32 param_stride);
+
+/* Asynchronous smp_function; see smprc.h. */
+SMP_HANDLE smp_function_async(U32 apicid, CALLBACK function, void *param);
+bool smp_poll(SMP_HANDLE handle);
+void smp_wait(SMP_HANDLE handle);
+U32 smp_wait_any(const SMP_HANDLE *handles, U32 count);
+
+/* Run a batch of work items on all idle APs; see smprc.h. */
+U32 smp_submit_work(const SMP_WORK *work, U32 count, bool steal);
+
+/* Parallel memory primitives; see smprc.h. */
+bool smp_memset(void *dest, U8 value, unsigned long size);
+bool smp_memcpy(void *dest, const void *src, unsigned long size);
+bool smp_mem_verify(const void *addr, unsigned long size, U64 pattern, unsigned long *first_bad);
+bool smp_mem_hash(const void *addr, unsigned long size, U64 *hash);
+
 bool smp_get_mwait(U32 apicid, bool *use_mwait, U32 *mwait_hint, U32 *int_break_event);
 void smp_set_mwait(U32 apicid, bool use_mwait, U32 mwait_hint, U32 int_break_event);
 
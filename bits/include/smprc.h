@@ -39,12 +39,22 @@ typedef struct cpu_info {
 
 typedef void (*CALLBACK)(void *);
 
+/* Identifies a callback started by smp_function_async; see below. */
+typedef U32 SMP_HANDLE;
+#define SMP_HANDLE_INVALID 0
+
+/* One item for smp_submit_work. */
+typedef struct smp_work {
+    CALLBACK function;
+    void *param;
+} SMP_WORK;
+
 /* smp_init_with_memory returns the number of CPUs, or 0 on error. */
 U32 smp_init_with_memory(void *working_memory, void *page_below_1M, void *reserved_mwait_memory);
 
 #define SMP_MAX_LOGICAL_CPU 384
 #define SMP_MWAIT_ALIGN 64
-#define SMP_WORKING_MEMORY_SIZE (810*1024)
+#define SMP_WORKING_MEMORY_SIZE (952*1024)
 #define SMP_WORKING_MEMORY_ALIGN 16
 #define SMP_LOW_MEMORY_SIZE 4096
 #define SMP_LOW_MEMORY_ALIGN 4096
@@ -65,6 +75,58 @@ const CPU_INFO *smp_read_cpu_list_with_memory(void *working_memory);
 
 U32 smp_function_with_memory(void *working_memory, U32 apicid, CALLBACK function, void *param);
 
+/* Run function on every CPU whose APIC ID is in apicids[0..count) at the same
+ * time, and return once all of them finish.  CPU apicids[i] gets
+ * param + i * param_stride, so a stride of 0 passes the same param to all of
+ * them.  Returns the number of CPUs the function ran on. */
+U32 smp_function_multicast_with_memory(void *working_memory, const U32 *apicids, U32 count, CALLBACK function, void *param, U32 param_stride);
+
+/* Same as smp_function_multicast_with_memory on every CPU, BSP included; the
+ * CPU at index i of smp_read_cpu_list_with_memory gets param + i * param_stride. */
+U32 smp_function_broadcast_with_memory(void *working_memory, CALLBACK function, void *param, U32 param_stride);
+
+/* Start function on the CPU and return without waiting for it, or return
+ * SMP_HANDLE_INVALID if the CPU is unknown or still busy.  A callback on the
+ * BSP runs before this returns.  The CPU takes no other work until the
+ * callback finishes. */
+SMP_HANDLE smp_function_async_with_memory(void *working_memory, U32 apicid, CALLBACK function, void *param);
+
+/* Returns true once the callback behind handle has finished.  Invalid and
+ * stale handles count as finished. */
+bool smp_poll_with_memory(void *working_memory, SMP_HANDLE handle);
+
+/* Wait for the callback behind handle to finish. */
+void smp_wait_with_memory(void *working_memory, SMP_HANDLE handle);
+
+/* Wait until any of handles[0..count) finishes and return its index, or count
+ * if there is nothing to wait for.  SMP_HANDLE_INVALID entries are skipped, so
+ * a list of only invalid handles returns count; stale handles count as
+ * finished. */
+U32 smp_wait_any_with_memory(void *working_memory, const SMP_HANDLE *handles, U32 count);
+
+/* Run work[0..count) spread over per-CPU queues on every idle AP, and return
+ * once all of it is done.  With steal set, an AP whose own queue runs dry
+ * takes items from the other queues.  Items run in no particular order, and
+ * the BSP runs any that find every queue full.  Returns the number of items
+ * run; items with a NULL function are skipped. */
+U32 smp_submit_work_with_memory(void *working_memory, const SMP_WORK *work, U32 count, bool steal);
+
+/* Memory primitives spread over every idle CPU.  The range is cut into 1MB
+ * chunks.  Where the SRAT says which NUMA node a chunk's memory and a CPU
+ * belong to, each CPU takes chunks on its own node before helping with the
+ * rest.  All return false if SMP is not initialized. */
+bool smp_memset_with_memory(void *working_memory, void *dest, U8 value, unsigned long size);
+/* dest and src must not overlap. */
+bool smp_memcpy_with_memory(void *working_memory, void *dest, const void *src, unsigned long size);
+/* Check addr[0..size) against pattern, repeated every 8 bytes from addr.
+ * Sets *first_bad to the offset of the first mismatching byte, or to size if
+ * there is none. */
+bool smp_mem_verify_with_memory(void *working_memory, const void *addr, unsigned long size, U64 pattern, unsigned long *first_bad);
+/* A 64-bit hash of addr[0..size): FNV-1a over each chunk, combined by chunk
+ * position.  It does not depend on the number of CPUs, but it is not plain
+ * FNV-1a of the whole range. */
+bool smp_mem_hash_with_memory(void *working_memory, const void *addr, unsigned long size, U64 *hash);
+
 bool smp_get_mwait_with_memory(void *working_memory, U32 apicid, bool *use_mwait, U32 *mwait_hint, U32 *int_break_event);
 void smp_set_mwait_with_memory(void *working_memory, U32 apicid, bool use_mwait, U32 mwait_hint, U32 int_break_event);
 
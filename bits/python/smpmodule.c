@@ -819,6 +819,59 @@ static PyObject *bits_set_mwait(PyObject *self, PyObject *args)
     return Py_BuildValue("");
 }
 
+static PyObject *bits_memset(PyObject *self, PyObject *args)
+{
+    unsigned long dest, size;
+    unsigned char value;
+    if (!PyArg_ParseTuple(args, "kbk:memset", &dest, &value, &size))
+        return NULL;
+    if (!smp_init())
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+    if (!smp_memset((void *)dest, value, size))
+        return PyErr_Format(PyExc_RuntimeError, "SMP memset failed");
+    return Py_BuildValue("");
+}
+
+static PyObject *bits_memcpy(PyObject *self, PyObject *args)
+{
+    unsigned long dest, src, size;
+    if (!PyArg_ParseTuple(args, "kkk:memcpy", &dest, &src, &size))
+        return NULL;
+    if (!smp_init())
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+    if (!smp_memcpy((void *)dest, (const void *)src, size))
+        return PyErr_Format(PyExc_RuntimeError, "SMP memcpy failed; do the ranges overlap?");
+    return Py_BuildValue("");
+}
+
+static PyObject *bits_mem_verify(PyObject *self, PyObject *args)
+{
+    unsigned long addr, size, first_bad;
+    U64 pattern;
+    if (!PyArg_ParseTuple(args, "kkK:mem_verify", &addr, &size, &pattern))
+        return NULL;
+    if (!smp_init())
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+    if (!smp_mem_verify((const void *)addr, size, pattern, &first_bad))
+        return PyErr_Format(PyExc_RuntimeError, "SMP mem_verify failed");
+    if (first_bad == size)
+        return Py_BuildValue("");
+    return Py_BuildValue("k", first_bad);
+}
+
+static PyObject *bits_mem_hash(PyObject *self, PyObject *args)
+{
+    unsigned long addr, size;
+    U64 hash;
+    if (!PyArg_ParseTuple(args, "kk:mem_hash", &addr, &size))
+        return NULL;
+    if (!smp_init())
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+    if (!smp_mem_hash((const void *)addr, size, &hash))
+        return PyErr_Format(PyExc_RuntimeError, "SMP mem_hash failed");
+    return Py_BuildValue("K", hash);
+}
+
 static PyMethodDef smpMethods[] = {
     {"bclk", bits_bclk, METH_NOARGS, "bclk() -> bclk (in MHz)"},
     {"blocking_sleep", bits_blocking_sleep, METH_VARARGS, "sleep using mwait for the specified number of microseconds"},
@@ -828,6 +881,10 @@ static PyMethodDef smpMethods[] = {
     {"inb", (PyCFunction)bits_inb, METH_KEYWORDS, "inb(port[, apicid=BSP]) -> read byte from IO port on the specified CPU"},
     {"inw", (PyCFunction)bits_inw, METH_KEYWORDS, "inw(port[, apicid=BSP]) -> read word from IO port on the specified CPU"},
     {"inl", (PyCFunction)bits_inl, METH_KEYWORDS, "inl(port[, apicid=BSP]) -> read dword from IO port on the specified CPU"},
+    {"mem_hash", bits_mem_hash, METH_VARARGS, "mem_hash(address, size) -> long hash of the memory range, computed on all CPUs"},
+    {"mem_verify", bits_mem_verify, METH_VARARGS, "mem_verify(address, size, pattern) -> offset of the first byte not matching the repeated 64-bit pattern (None if all match), checked on all CPUs"},
+    {"memcpy", bits_memcpy, METH_VARARGS, "memcpy(dest, src, size) -> copy non-overlapping memory using all CPUs"},
+    {"memset", bits_memset, METH_VARARGS, "memset(address, value, size) -> fill memory with a byte using all CPUs"},
     {"outb", (PyCFunction)bits_outb, METH_KEYWORDS, "outb(port, value[, apicid=BSP]) -> write byte to IO port on the specified CPU"},
     {"outw", (PyCFunction)bits_outw, METH_KEYWORDS, "outw(port, value[, apicid=BSP]) -> write word to IO port on the specified CPU"},
     {"outl", (PyCFunction)bits_outl, METH_KEYWORDS, "outl(port, value[, apicid=BSP]) -> write dword to IO port on the specified CPU"},
@@ -111,6 +111,61 @@ U32 smp_function(U32 apicid, CALLBACK function, void *param)
     return smp_function_with_memory(global_working_memory, apicid, function, param);
 }
 
+U32 smp_function_multicast(const U32 *apicids, U32 count, CALLBACK function, void *param, U32 param_stride)
+{
+    return smp_function_multicast_with_memory(global_working_memory, apicids, count, function, param, param_stride);
+}
+
+U32 smp_function_broadcast(CALLBACK function, void *param, U32 param_stride)
+{
+    return smp_function_broadcast_with_memory(global_working_memory, function, param, param_stride);
+}
+
+SMP_HANDLE smp_function_async(U32 apicid, CALLBACK function, void *param)
+{
+    return smp_function_async_with_memory(global_working_memory, apicid, function, param);
+}
+
+bool smp_poll(SMP_HANDLE handle)
+{
+    return smp_poll_with_memory(global_working_memory, handle);
+}
+
+void smp_wait(SMP_HANDLE handle)
+{
+    smp_wait_with_memory(global_working_memory, handle);
+}
+
+U32 smp_wait_any(const SMP_HANDLE *handles, U32 count)
+{
+    return smp_wait_any_with_memory(global_working_memory, handles, count);
+}
+
+U32 smp_submit_work(const SMP_WORK *work, U32 count, bool steal)
+{
+    return smp_submit_work_with_memory(global_working_memory, work, count, steal);
+}
+
+bool smp_memset(void *dest, U8 value, unsigned long size)
+{
+    return smp_memset_with_memory(global_working_memory, dest, value, size);
+}
+
+bool smp_memcpy(void *dest, const void *src, unsigned long size)
+{
+    return smp_memcpy_with_memory(global_working_memory, dest, src, size);
+}
+
+bool smp_mem_verify(const void *addr, unsigned long size, U64 pattern, unsigned long *first_bad)
+{
+    return smp_mem_verify_with_memory(global_working_memory, addr, size, pattern, first_bad);
+}
+
+bool smp_mem_hash(const void *addr, unsigned long size, U64 *hash)
+{
+    return smp_mem_hash_with_memory(global_working_memory, addr, size, hash);
+}
+
 void smp_sleep(U32 microseconds)
 {
     smp_sleep_with_memory(global_working_memory, microseconds);
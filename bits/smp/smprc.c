@@ -66,6 +66,7 @@ typedef struct cpu_data {
     U32 mwait_hint;
     U32 int_break_event;
     U32 status;
+    U32 generation;
     CALLBACK function;
     void *param;
 } CPU_DATA;
@@ -96,6 +97,57 @@ typedef struct exception_info {
 
 #define SMP_MAGIC 0x69534D50
 
+/* Memory primitives split their range into chunks of this size, claimed one
+ * at a time by the CPUs; must be a power of two. */
+#define MEM_CHUNK_SHIFT 20
+#define MEM_CHUNK_SIZE (1UL << MEM_CHUNK_SHIFT)
+
+/* Runs of chunks in the same NUMA proximity domain. */
+#define MEM_SEGMENTS_MAX 64
+#define MEM_DOMAIN_ANY 0xffffffff
+
+enum mem_op { MEM_SET, MEM_COPY, MEM_VERIFY, MEM_HASH };
+
+typedef struct mem_segment {
+    U32 domain;
+    U32 next; // next chunk to claim
+    U32 end;
+} MEM_SEGMENT;
+
+typedef struct mem_job {
+    enum mem_op op;
+    U8 *dest;
+    const U8 *src;
+    U64 pattern;
+    unsigned long size;
+    struct acpi_table_srat *srat;
+    U32 nsegments;
+    MEM_SEGMENT segment[MEM_SEGMENTS_MAX];
+} MEM_JOB;
+
+/* What each CPU found, combined by the BSP afterwards. */
+typedef struct mem_result {
+    MEM_JOB *job;
+    unsigned long first_bad;
+    U64 hash;
+} MEM_RESULT;
+
+/* Items per CPU work queue; must be a power of two. */
+#define WORK_QUEUE_SIZE 16
+
+/* A ring filled by the BSP only and emptied by its CPU and, when stealing, by
+ * the other CPUs; head is claimed with a locked compare-and-exchange. */
+typedef struct work_queue {
+    U32 head;
+    U32 tail;
+    U8 reserved[SMP_MWAIT_ALIGN - 2 * sizeof(U32)];
+    SMP_WORK item[WORK_QUEUE_SIZE];
+} WORK_QUEUE;
+
+/* Open addressed map from APIC ID to processor index, filled in as the CPUs
+ * check in.  Must be a power of two and at least twice SMP_MAX_LOGICAL_CPU. */
+#define APICID_MAP_SIZE 1024
+
 typedef struct smp_host {
     U32 initialized;
     void *mem_region_below_1M;
@@ -107,7 +159,12 @@ typedef struct smp_host {
     asmlinkage void (*wait_for_control)(U32 *, U32, U32, U32, U32);
     U8 *control;
     CPU_INFO cpu[SMP_MAX_LOGICAL_CPU];
+    U16 apicid_map[APICID_MAP_SIZE]; // processor index + 1, or 0 for an empty slot
     CPU_DATA cpu_data[SMP_MAX_LOGICAL_CPU];
+    WORK_QUEUE queue[SMP_MAX_LOGICAL_CPU];
+    U32 work_open;
+    U32 work_steal;
+    MEM_RESULT mem_result[SMP_MAX_LOGICAL_CPU];
     U8 control_region[SMP_MWAIT_ALIGN * SMP_MAX_LOGICAL_CPU + SMP_MWAIT_ALIGN];
 } SMP_HOST;
 
@@ -119,6 +176,7 @@ static void ap_park(void *param);
 
 static U32 find_processor_id_for_this_cpu(U32 * processor_id, SMP_HOST * host);
 static U32 find_processor_id_for_this_apicid(U32 apicid, U32 * processor_id, SMP_HOST * host);
+static void map_apicid(SMP_HOST * host, U32 processor_id);
 
 static const IDTR real_mode_idtr = { .limit = 0x3ff, .base = 0 };
 
@@ -687,6 +745,7 @@ asmlinkage void find_logical_processors(void *param)
     read_apicid(&host->cpu[processor_id].apicid);
 
     host->cpu[processor_id].present = 1;
+    map_apicid(host, processor_id);
 
     prepare_mp_worker(param);
 }
@@ -806,14 +865,36 @@ void prepare_mp_worker(void *param)
     switch_stack_and_call(mp_worker, param, stack_top);
 }
 
+//-----------------------------------------------------------------------------
+static U32 apicid_slot(U32 apicid)
+{
+    // xAPIC IDs and the low bits of x2APIC IDs are mostly dense, so they index the map directly
+    return (apicid ^ (apicid >> 16)) & (APICID_MAP_SIZE - 1);
+}
+
+//-----------------------------------------------------------------------------
+void map_apicid(SMP_HOST * host, U32 processor_id)
+{
+    U32 slot;
+
+    for (slot = apicid_slot(host->cpu[processor_id].apicid); host->apicid_map[slot]; slot = (slot + 1) & (APICID_MAP_SIZE - 1))
+        ;
+
+    /* APs already checked in look themselves up while others are still being
+     * added, so the CPU entry must be visible before the slot pointing at it. */
+    asm volatile ("" ::: "memory");
+    *(volatile U16 *)&host->apicid_map[slot] = processor_id + 1;
+}
+
 //-----------------------------------------------------------------------------
 U32 find_processor_id_for_this_apicid(U32 apicid, U32 * processor_id, SMP_HOST * host)
 {
-    U32 i;
+    U32 slot;
+    U16 entry;
 
-    for (i = 0; i < host->logical_processor_count; i++)
-        if (host->cpu[i].apicid == apicid) {
-            *processor_id = i;
+    for (slot = apicid_slot(apicid); (entry = *(volatile U16 *)&host->apicid_map[slot]) != 0; slot = (slot + 1) & (APICID_MAP_SIZE - 1))
+        if (host->cpu[entry - 1].apicid == apicid) {
+            *processor_id = entry - 1;
             return 1;
         }
 
@@ -1044,11 +1125,14 @@ U32 smp_init_with_memory(void *working_memory, void *page_below_1M, void *reserv
             host->cpu_data[i].int_break_event = 1;
             host->cpu_data[i].function = ap_park;
             host->cpu_data[i].param = NULL;
+            host->queue[i].head = host->queue[i].tail = 0;
         }
     }
 
+    memset(host->apicid_map, 0, sizeof(host->apicid_map));
     host->cpu[0].present = 1;
     read_apicid(&host->cpu[0].apicid);
+    map_apicid(host, 0);
 
     host->bclk = compute_bclk();
 
@@ -1087,6 +1171,46 @@ const CPU_INFO *smp_read_cpu_list_with_memory(void *working_memory)
     return host->cpu;
 }
 
+static U32 *cpu_control(SMP_HOST * host, U32 processor_id)
+{
+    return (U32 *) (host->control + processor_id * SMP_MWAIT_ALIGN);
+}
+
+static void run_on_bsp(SMP_HOST * host, CALLBACK function, void *param)
+{
+    struct exception_info *e = &host->bsp_exception_info;
+    if (e->gpf_idtr_installed) {
+        set_idtr(&host->bsp_exception_info.idt_descriptor);
+        function(param);
+        set_idtr(&real_mode_idtr);
+    } else {
+        struct gate old_gate;
+        get_gate(0xd, &old_gate);
+        set_protected_mode_exception_handler(0xd, gpfHandler);
+        function(param);
+        set_gate(0xd, &old_gate);
+    }
+}
+
+/* Hand function to an idle AP and return without waiting for it. */
+static U32 start_on_ap(SMP_HOST * host, U32 processor_id, CALLBACK function, void *param)
+{
+    CPU_DATA *cpu_data = &host->cpu_data[processor_id];
+    U32 *my_control = cpu_control(host, processor_id);
+
+    // Check if AP is available - FIXME: this should be an assert
+    if (*(volatile U32 *)my_control != BSP_IN_CONTROL)
+        return 0;
+
+    // Assign the function and its parameter
+    cpu_data->function = function;
+    cpu_data->param = param;
+    cpu_data->generation++;
+
+    set_control(my_control, AP_IN_CONTROL);
+    return 1;
+}
+
 U32 smp_function_with_memory(void *working_memory, U32 apicid, CALLBACK function, void *param)
 {
     struct smp_host *host = working_memory;
@@ -1101,47 +1225,663 @@ U32 smp_function_with_memory(void *working_memory, U32 apicid, CALLBACK function
     }
 
     if (apicid == host->cpu[0].apicid) {
-        struct exception_info *e = &host->bsp_exception_info;
-        if (e->gpf_idtr_installed) {
-            set_idtr(&host->bsp_exception_info.idt_descriptor);
-            function(param);
-            set_idtr(&real_mode_idtr);
-        } else {
-            struct gate old_gate;
-            get_gate(0xd, &old_gate);
-            set_protected_mode_exception_handler(0xd, gpfHandler);
-            function(param);
-            set_gate(0xd, &old_gate);
-        }
+        run_on_bsp(host, function, param);
     } else {
         U32 processor_id;
         CPU_DATA *cpu_data;
-        U32 *my_control;
 
         if (find_processor_id_for_this_apicid(apicid, &processor_id, host) == 0) {
             dprintf("smp", "smp_function returning 0 because APIC ID not found\n");
             return 0;
         }
 
-        cpu_data = &host->cpu_data[processor_id];
-        my_control = (U32 *) (host->control + processor_id * SMP_MWAIT_ALIGN);
-
-        // Check if AP is available - FIXME: this should be an assert
-        if (*my_control != BSP_IN_CONTROL) {
+        if (!start_on_ap(host, processor_id, function, param)) {
             dprintf("smp", "smp_function returning 0 because BSP not in control\n");
             return 0;
         }
-        // Assign the function and its parameter
-        cpu_data->function = function;
-        cpu_data->param = param;
 
-        set_control(my_control, AP_IN_CONTROL);
-        host->wait_for_control(my_control, BSP_IN_CONTROL, cpu_data[0].use_mwait && mwait_supported(), cpu_data[0].mwait_hint, cpu_data[0].int_break_event && int_break_event_supported());
+        cpu_data = &host->cpu_data[processor_id];
+        host->wait_for_control(cpu_control(host, processor_id), BSP_IN_CONTROL, cpu_data[0].use_mwait && mwait_supported(), cpu_data[0].mwait_hint, cpu_data[0].int_break_event && int_break_event_supported());
     }
 
     return 1;
 }
 
+#define SMP_BITMAP_WORDS ((SMP_MAX_LOGICAL_CPU + 31) / 32)
+
+static void *multicast_param(void *param, U32 param_stride, U32 index)
+{
+    if (!param_stride)
+        return param;
+    return (U8 *) param + index * param_stride;
+}
+
+/* Spin until every AP in the pending bitmap has handed control back. */
+static void wait_for_pending(SMP_HOST * host, U32 * pending)
+{
+    U32 busy;
+
+    do {
+        U32 i, bit;
+
+        busy = 0;
+        for (i = 0; i < SMP_BITMAP_WORDS; i++)
+            for (bit = 0; bit < 32; bit++) {
+                if (!(pending[i] & (1U << bit)))
+                    continue;
+                if (*(volatile U32 *)cpu_control(host, i * 32 + bit) == BSP_IN_CONTROL)
+                    pending[i] &= ~(1U << bit);
+                else
+                    busy = 1;
+            }
+        if (busy)
+            pause32();
+    } while (busy);
+}
+
+/* Start function on every CPU in the selection at once, run the BSP's share
+ * (if any) while the APs run theirs, then wait for all of them. */
+static U32 multicast(SMP_HOST * host, const U32 * apicids, U32 count, CALLBACK function, void *param, U32 param_stride)
+{
+    U32 pending[SMP_BITMAP_WORDS];
+    void *bsp_param = NULL;
+    bool bsp_selected = false;
+    U32 started = 0;
+    U32 i;
+
+    memset(pending, 0, sizeof(pending));
+
+    for (i = 0; i < count; i++) {
+        U32 processor_id;
+
+        if (apicids) {
+            if (apicids[i] == host->cpu[0].apicid)
+                processor_id = 0;
+            else if (find_processor_id_for_this_apicid(apicids[i], &processor_id, host) == 0) {
+                dprintf("smp", "smp_function_multicast skipping APIC ID %u: not found\n", apicids[i]);
+                continue;
+            }
+        } else
+            processor_id = i;
+
+        if (processor_id == 0) {
+            bsp_selected = true;
+            bsp_param = multicast_param(param, param_stride, i);
+            continue;
+        }
+
+        if (pending[processor_id / 32] & (1U << (processor_id % 32)))
+            continue;
+
+        if (!start_on_ap(host, processor_id, function, multicast_param(param, param_stride, i))) {
+            dprintf("smp", "smp_function_multicast skipping APIC ID %u: BSP not in control\n", host->cpu[processor_id].apicid);
+            continue;
+        }
+
+        pending[processor_id / 32] |= 1U << (processor_id % 32);
+        started++;
+    }
+
+    if (bsp_selected) {
+        run_on_bsp(host, function, bsp_param);
+        started++;
+    }
+
+    wait_for_pending(host, pending);
+
+    return started;
+}
+
+U32 smp_function_multicast_with_memory(void *working_memory, const U32 * apicids, U32 count, CALLBACK function, void *param, U32 param_stride)
+{
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC) {
+        dprintf("smp", "smp_function_multicast returning 0 because working memory not initialized\n");
+        return 0;
+    }
+
+    if (!function || !apicids) {
+        dprintf("smp", "smp_function_multicast returning 0 because !function or !apicids\n");
+        return 0;
+    }
+
+    return multicast(host, apicids, count, function, param, param_stride);
+}
+
+U32 smp_function_broadcast_with_memory(void *working_memory, CALLBACK function, void *param, U32 param_stride)
+{
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC) {
+        dprintf("smp", "smp_function_broadcast returning 0 because working memory not initialized\n");
+        return 0;
+    }
+
+    if (!function) {
+        dprintf("smp", "smp_function_broadcast returning 0 because !function\n");
+        return 0;
+    }
+
+    return multicast(host, NULL, host->logical_processor_count, function, param, param_stride);
+}
+
+/* A handle is the processor index plus one in the low 16 bits, and the
+ * generation of that processor's work in the high 16 bits, so that a stale
+ * handle reads as complete rather than waiting on somebody else's work. */
+#define HANDLE_PROCESSOR(handle) (((handle) & 0xffff) - 1)
+#define HANDLE_GENERATION(handle) ((handle) >> 16)
+
+static SMP_HANDLE make_handle(SMP_HOST * host, U32 processor_id)
+{
+    return ((host->cpu_data[processor_id].generation & 0xffff) << 16) | (processor_id + 1);
+}
+
+static bool handle_done(SMP_HOST * host, SMP_HANDLE handle)
+{
+    U32 processor_id = HANDLE_PROCESSOR(handle);
+
+    if (handle == SMP_HANDLE_INVALID || processor_id >= host->logical_processor_count)
+        return true;
+    if ((host->cpu_data[processor_id].generation & 0xffff) != HANDLE_GENERATION(handle))
+        return true;
+    return *(volatile U32 *)cpu_control(host, processor_id) == BSP_IN_CONTROL;
+}
+
+SMP_HANDLE smp_function_async_with_memory(void *working_memory, U32 apicid, CALLBACK function, void *param)
+{
+    U32 processor_id;
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC) {
+        dprintf("smp", "smp_function_async returning invalid handle because working memory not initialized\n");
+        return SMP_HANDLE_INVALID;
+    }
+
+    if (!function) {
+        dprintf("smp", "smp_function_async returning invalid handle because !function\n");
+        return SMP_HANDLE_INVALID;
+    }
+
+    // The BSP cannot run anything behind its own back, so it runs now and the handle is already complete
+    if (apicid == host->cpu[0].apicid) {
+        run_on_bsp(host, function, param);
+        return make_handle(host, 0);
+    }
+
+    if (find_processor_id_for_this_apicid(apicid, &processor_id, host) == 0) {
+        dprintf("smp", "smp_function_async returning invalid handle because APIC ID not found\n");
+        return SMP_HANDLE_INVALID;
+    }
+
+    if (!start_on_ap(host, processor_id, function, param)) {
+        dprintf("smp", "smp_function_async returning invalid handle because BSP not in control\n");
+        return SMP_HANDLE_INVALID;
+    }
+
+    return make_handle(host, processor_id);
+}
+
+bool smp_poll_with_memory(void *working_memory, SMP_HANDLE handle)
+{
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC)
+        return true;
+    return handle_done(host, handle);
+}
+
+void smp_wait_with_memory(void *working_memory, SMP_HANDLE handle)
+{
+    CPU_DATA *cpu_data;
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC)
+        return;
+
+    if (handle_done(host, handle))
+        return;
+
+    // Same wait as the synchronous smp_function, using the target's mwait settings
+    cpu_data = &host->cpu_data[HANDLE_PROCESSOR(handle)];
+    host->wait_for_control(cpu_control(host, HANDLE_PROCESSOR(handle)), BSP_IN_CONTROL, cpu_data->use_mwait && mwait_supported(), cpu_data->mwait_hint, cpu_data->int_break_event && int_break_event_supported());
+}
+
+U32 smp_wait_any_with_memory(void *working_memory, const SMP_HANDLE * handles, U32 count)
+{
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC || !handles || !count)
+        return count;
+
+    for (;;) {
+        U32 i;
+        bool live = false;
+
+        for (i = 0; i < count; i++) {
+            // An invalid handle never started anything, so it never finishes
+            if (handles[i] == SMP_HANDLE_INVALID)
+                continue;
+            live = true;
+            if (handle_done(host, handles[i]))
+                return i;
+        }
+        if (!live)
+            return count;
+        pause32();
+    }
+}
+
+static inline bool cmpxchg32(U32 * ptr, U32 old, U32 new)
+{
+    U8 ok;
+    asm volatile ("lock cmpxchgl %[new], %[ptr]\n\tsete %[ok]" : [ptr] "+m" (*ptr), [ok] "=q" (ok), "+a" (old) : [new] "r" (new) : "memory");
+    return ok;
+}
+
+/* Take one item off the queue; returns false if it was empty. */
+static bool work_take(WORK_QUEUE * queue, SMP_WORK * work)
+{
+    for (;;) {
+        U32 head = *(volatile U32 *)&queue->head;
+
+        if (head == *(volatile U32 *)&queue->tail)
+            return false;
+
+        // The item must be read after the tail that published it
+        asm volatile ("" ::: "memory");
+        *work = queue->item[head % WORK_QUEUE_SIZE];
+
+        if (cmpxchg32(&queue->head, head, head + 1))
+            return true;
+    }
+}
+
+/* Take one item from any other CPU's queue; returns false if they were all empty. */
+static bool work_steal(SMP_HOST * host, U32 processor_id, SMP_WORK * work)
+{
+    U32 i;
+
+    for (i = 1; i < host->logical_processor_count; i++)
+        if (work_take(&host->queue[(processor_id + i) % host->logical_processor_count], work))
+            return true;
+
+    return false;
+}
+
+/* Runs on each AP for the length of smp_submit_work. */
+static void work_drain(void *param)
+{
+    SMP_HOST *host = param;
+    U32 processor_id;
+
+    if (find_processor_id_for_this_cpu(&processor_id, host) == 0)
+        return;
+
+    for (;;) {
+        // Nothing is queued after work_open drops, so an empty pass after that means done
+        U32 open = *(volatile U32 *)&host->work_open;
+        SMP_WORK work;
+
+        if (work_take(&host->queue[processor_id], &work)
+            || (host->work_steal && work_steal(host, processor_id, &work))) {
+            work.function(work.param);
+            continue;
+        }
+        if (!open)
+            return;
+        pause32();
+    }
+}
+
+/* Queue work on the next started AP with room, round robin; returns false if all are full. */
+static bool work_push(SMP_HOST * host, const U32 * started, U32 * next, const SMP_WORK * work)
+{
+    U32 i;
+
+    for (i = 1; i < host->logical_processor_count; i++) {
+        U32 processor_id = *next;
+        WORK_QUEUE *queue = &host->queue[processor_id];
+
+        *next = processor_id + 1 < host->logical_processor_count ? processor_id + 1 : 1;
+
+        if (!(started[processor_id / 32] & (1U << (processor_id % 32))))
+            continue;
+        if (queue->tail - *(volatile U32 *)&queue->head >= WORK_QUEUE_SIZE)
+            continue;
+
+        queue->item[queue->tail % WORK_QUEUE_SIZE] = *work;
+        // Publish the item before the tail that covers it
+        asm volatile ("" ::: "memory");
+        *(volatile U32 *)&queue->tail = queue->tail + 1;
+        return true;
+    }
+
+    return false;
+}
+
+U32 smp_submit_work_with_memory(void *working_memory, const SMP_WORK * work, U32 count, bool steal)
+{
+    U32 pending[SMP_BITMAP_WORDS];
+    U32 workers = 0;
+    U32 next = 1;
+    U32 done = 0;
+    U32 i;
+
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC) {
+        dprintf("smp", "smp_submit_work returning 0 because working memory not initialized\n");
+        return 0;
+    }
+
+    if (!work)
+        return 0;
+
+    memset(pending, 0, sizeof(pending));
+    host->work_steal = steal;
+    *(volatile U32 *)&host->work_open = 1;
+
+    // APs still busy with an asynchronous callback get no queue
+    for (i = 1; i < host->logical_processor_count; i++)
+        if (start_on_ap(host, i, work_drain, host)) {
+            pending[i / 32] |= 1U << (i % 32);
+            workers++;
+        }
+
+    for (i = 0; i < count; i++) {
+        if (!work[i].function)
+            continue;
+        // Rather than wait for room, the BSP does the work itself
+        if (!workers || !work_push(host, pending, &next, &work[i]))
+            run_on_bsp(host, work[i].function, work[i].param);
+        done++;
+    }
+
+    asm volatile ("" ::: "memory");
+    *(volatile U32 *)&host->work_open = 0;
+
+    if (steal) {
+        SMP_WORK stolen;
+
+        while (work_steal(host, 0, &stolen))
+            run_on_bsp(host, stolen.function, stolen.param);
+    }
+
+    wait_for_pending(host, pending);
+
+    return done;
+}
+
+static inline U32 fetch_add32(U32 * ptr, U32 value)
+{
+    asm volatile ("lock xaddl %[value], %[ptr]" : [ptr] "+m" (*ptr), [value] "+r" (value) : : "memory");
+    return value;
+}
+
+static struct acpi_table_srat *read_srat(void)
+{
+    struct acpi_table_srat *srat;
+
+    if (!acpica_early_init())
+        return NULL;
+
+    if (AcpiGetTable((char *)"SRAT", 1, (ACPI_TABLE_HEADER **)&srat) != AE_OK)
+        return NULL;
+
+    return srat;
+}
+
+/* Proximity domain of the CPU with this APIC ID, or MEM_DOMAIN_ANY if the SRAT does not say. */
+static U32 srat_cpu_domain(struct acpi_table_srat *srat, U32 apicid)
+{
+    void *current;
+    void *end;
+
+    if (!srat)
+        return MEM_DOMAIN_ANY;
+
+    current = srat + 1;
+    end = (U8 *) srat + srat->Header.Length;
+
+    while (current < end) {
+        struct acpi_subtable_header *subtable = current;
+
+        if (subtable->Length == 0)
+            break;
+
+        switch (subtable->Type) {
+        case ACPI_SRAT_TYPE_CPU_AFFINITY:
+            {
+                struct acpi_srat_cpu_affinity *cpu = current;
+                if ((cpu->Flags & ACPI_SRAT_CPU_USE_AFFINITY) && cpu->ApicId == apicid)
+                    return cpu->ProximityDomainLo | (cpu->ProximityDomainHi[0] << 8) | (cpu->ProximityDomainHi[1] << 16) | ((U32) cpu->ProximityDomainHi[2] << 24);
+                break;
+            }
+        case ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY:
+            {
+                struct acpi_srat_x2apic_cpu_affinity *x2apic = current;
+                if ((x2apic->Flags & ACPI_SRAT_CPU_ENABLED) && x2apic->ApicId == apicid)
+                    return x2apic->ProximityDomain;
+                break;
+            }
+        } // switch
+
+        current = (U8 *) subtable + subtable->Length;
+    } // while
+
+    return MEM_DOMAIN_ANY;
+}
+
+/* Proximity domain of the memory at this address, or MEM_DOMAIN_ANY if the SRAT does not say. */
+static U32 srat_memory_domain(struct acpi_table_srat *srat, U64 address)
+{
+    void *current;
+    void *end;
+
+    if (!srat)
+        return MEM_DOMAIN_ANY;
+
+    current = srat + 1;
+    end = (U8 *) srat + srat->Header.Length;
+
+    while (current < end) {
+        struct acpi_subtable_header *subtable = current;
+
+        if (subtable->Length == 0)
+            break;
+
+        if (subtable->Type == ACPI_SRAT_TYPE_MEMORY_AFFINITY) {
+            struct acpi_srat_mem_affinity *mem = current;
+            if ((mem->Flags & ACPI_SRAT_MEM_ENABLED) && address >= mem->BaseAddress && address - mem->BaseAddress < mem->Length)
+                return mem->ProximityDomain;
+        }
+
+        current = (U8 *) subtable + subtable->Length;
+    }
+
+    return MEM_DOMAIN_ANY;
+}
+
+/* Group the chunks of the job by the domain their memory is in. */
+static void mem_segments(MEM_JOB * job)
+{
+    U32 nchunks = (job->size + MEM_CHUNK_SIZE - 1) >> MEM_CHUNK_SHIFT;
+    U8 *base = job->op == MEM_SET || job->op == MEM_COPY ? job->dest : (U8 *) job->src;
+    U32 chunk;
+
+    job->nsegments = 0;
+    for (chunk = 0; chunk < nchunks; chunk++) {
+        U32 domain = srat_memory_domain(job->srat, (unsigned long)(base + ((unsigned long)chunk << MEM_CHUNK_SHIFT)));
+        MEM_SEGMENT *segment = job->nsegments ? &job->segment[job->nsegments - 1] : NULL;
+
+        if (!segment || (segment->domain != domain && job->nsegments < MEM_SEGMENTS_MAX)) {
+            segment = &job->segment[job->nsegments++];
+            segment->domain = domain;
+            segment->next = chunk;
+        } else if (segment->domain != domain)
+            // Out of segments; the rest is not local to anybody in particular
+            segment->domain = MEM_DOMAIN_ANY;
+        segment->end = chunk + 1;
+    }
+}
+
+static void mem_chunk(MEM_JOB * job, MEM_RESULT * result, U32 chunk)
+{
+    unsigned long offset = (unsigned long)chunk << MEM_CHUNK_SHIFT;
+    unsigned long len = job->size - offset < MEM_CHUNK_SIZE ? job->size - offset : MEM_CHUNK_SIZE;
+    const U8 *pattern = (const U8 *)&job->pattern;
+    unsigned long i = 0;
+
+    switch (job->op) {
+    case MEM_SET:
+        memset(job->dest + offset, pattern[0], len);
+        break;
+    case MEM_COPY:
+        memcpy(job->dest + offset, job->src + offset, len);
+        break;
+    case MEM_VERIFY:
+        {
+            const U8 *p = job->src + offset;
+
+            // The pattern repeats every 8 bytes from the start of the range, and chunks start 8-byte aligned with it
+            if (!((unsigned long)p & 7))
+                for (; i + 8 <= len; i += 8)
+                    if (*(const U64 *)(p + i) != job->pattern)
+                        break;
+            for (; i < len; i++)
+                if (p[i] != pattern[i & 7]) {
+                    if (offset + i < result->first_bad)
+                        result->first_bad = offset + i;
+                    break;
+                }
+            break;
+        }
+    case MEM_HASH:
+        {
+            // FNV-1a over 64-bit words, with any tail a byte at a time
+            const U8 *p = job->src + offset;
+            U64 hash = 0xcbf29ce484222325ULL;
+
+            for (; i + 8 <= len; i += 8)
+                hash = (hash ^ *(const U64 *)(p + i)) * 0x100000001b3ULL;
+            for (; i < len; i++)
+                hash = (hash ^ p[i]) * 0x100000001b3ULL;
+
+            // Weight each chunk by its position, so the sum does not depend on which CPU did what
+            result->hash += hash * (2 * (U64) chunk + 1);
+            break;
+        }
+    }
+}
+
+/* Claim and process chunks of the segment until it runs out. */
+static void mem_segment_drain(MEM_JOB * job, MEM_RESULT * result, MEM_SEGMENT * segment)
+{
+    for (;;) {
+        U32 chunk;
+
+        if (*(volatile U32 *)&segment->next >= segment->end)
+            return;
+        chunk = fetch_add32(&segment->next, 1);
+        if (chunk >= segment->end)
+            return;
+        mem_chunk(job, result, chunk);
+    }
+}
+
+/* Runs on every CPU: first the chunks local to this CPU, then whatever is left. */
+static void mem_worker(void *param)
+{
+    MEM_RESULT *result = param;
+    MEM_JOB *job = result->job;
+    U32 apicid;
+    U32 domain;
+    U32 i;
+
+    read_apicid(&apicid);
+    domain = srat_cpu_domain(job->srat, apicid);
+
+    if (domain != MEM_DOMAIN_ANY)
+        for (i = 0; i < job->nsegments; i++)
+            if (job->segment[i].domain == domain)
+                mem_segment_drain(job, result, &job->segment[i]);
+
+    for (i = 0; i < job->nsegments; i++)
+        mem_segment_drain(job, result, &job->segment[i]);
+}
+
+static bool mem_run(void *working_memory, MEM_JOB * job)
+{
+    U32 i;
+
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC) {
+        dprintf("smp", "smp memory primitive returning false because working memory not initialized\n");
+        return false;
+    }
+
+    if (job->size >> MEM_CHUNK_SHIFT >= ~0U) {
+        dprintf("smp", "smp memory primitive returning false because the range is too large\n");
+        return false;
+    }
+
+    job->srat = read_srat();
+    mem_segments(job);
+
+    for (i = 0; i < host->logical_processor_count; i++) {
+        host->mem_result[i].job = job;
+        host->mem_result[i].first_bad = job->size;
+        host->mem_result[i].hash = 0;
+    }
+
+    return smp_function_broadcast_with_memory(working_memory, mem_worker, host->mem_result, sizeof(host->mem_result[0])) != 0;
+}
+
+bool smp_memset_with_memory(void *working_memory, void *dest, U8 value, unsigned long size)
+{
+    MEM_JOB job = { .op = MEM_SET, .dest = dest, .pattern = value, .size = size };
+    return mem_run(working_memory, &job);
+}
+
+bool smp_memcpy_with_memory(void *working_memory, void *dest, const void *src, unsigned long size)
+{
+    MEM_JOB job = { .op = MEM_COPY, .dest = dest, .src = src, .size = size };
+
+    if ((unsigned long)dest - (unsigned long)src < size || (unsigned long)src - (unsigned long)dest < size) {
+        dprintf("smp", "smp_memcpy returning false because the ranges overlap\n");
+        return false;
+    }
+
+    return mem_run(working_memory, &job);
+}
+
+bool smp_mem_verify_with_memory(void *working_memory, const void *addr, unsigned long size, U64 pattern, unsigned long *first_bad)
+{
+    MEM_JOB job = { .op = MEM_VERIFY, .src = addr, .pattern = pattern, .size = size };
+    struct smp_host *host = working_memory;
+    U32 i;
+
+    if (!mem_run(working_memory, &job))
+        return false;
+
+    *first_bad = size;
+    for (i = 0; i < host->logical_processor_count; i++)
+        if (host->mem_result[i].first_bad < *first_bad)
+            *first_bad = host->mem_result[i].first_bad;
+
+    return true;
+}
+
+bool smp_mem_hash_with_memory(void *working_memory, const void *addr, unsigned long size, U64 *hash)
+{
+    MEM_JOB job = { .op = MEM_HASH, .src = addr, .size = size };
+    struct smp_host *host = working_memory;
+    U32 i;
+
+    if (!mem_run(working_memory, &job))
+        return false;
+
+    *hash = size;
+    for (i = 0; i < host->logical_processor_count; i++)
+        *hash += host->mem_result[i].hash;
+
+    return true;
+}
+
 /* Called from smpasm directly, which won't use a C prototype, so just give one here to silence the warning. */
 asmlinkage void intHandler(void);
 asmlinkage void intHandler(void)
@@ -3,146 +3,1535 @@
 
 #include <grub/dl.h>
 #include <grub/disk.h>
+#include <grub/mm.h>
 #include <grub/misc.h>
+#include <grub/file.h>
+#include <grub/partition.h>
 #include <grub/extcmd.h>
+#include <grub/time.h>
 #include <grub/i18n.h>
+#include <grub/lib/crc.h>
 
 GRUB_MOD_LICENSE ("GPLv3+");
 
+/* Size of the transfer buffer, in MiB */
+#define RAIDDUMP_BUFFER_DEFAULT 4
+#define RAIDDUMP_BUFFER_MAX 16
+
+#define RAIDDUMP_BUFFER_ALIGN 4096
+
+/* Up to this many targets are written from one read of the source */
+#define RAIDDUMP_TARGETS_MAX 8
+
+/* Members of an assembled array */
+#define RAIDDUMP_MEMBERS_MAX 16
+
+/* Size of a chunk of an assembled array, in KiB */
+#define RAIDDUMP_STRIPE_DEFAULT 64
+#define RAIDDUMP_STRIPE_MAX 4096
+
+/* Number of transfer buffers in the pipeline. The disk layer only has
+   blocking reads, so more buffers would only be filled ahead of the writes,
+   never while they run */
+#define RAIDDUMP_BUFFERS 1
+
+#define RAIDDUMP_CHECKPOINT_MAGIC "RDCKPT02"
+
+/* After a failed read, a chunk is read again in pieces of this many sectors,
+   and only the pieces which fail are read sector by sector */
+#define RAIDDUMP_PIECE_LEN 64
+
+/* Reads of a bad sector with --continue-on-error */
+#define RAIDDUMP_RETRIES 3
+
+/* Ranges of bad sectors listed in the summary */
+#define RAIDDUMP_BAD_PRINT_MAX 32
+
+/* Progress is printed at most this often, in milliseconds */
+#define RAIDDUMP_PROGRESS_MS 5000
+
+/* The last chunk is read back from the target in pieces of this many sectors */
+#define RAIDDUMP_CHECK_LEN 128
+
+static const struct grub_arg_option options[] =
+  {
+    {"buffer", 'b', 0, N_("Size of the transfer buffer in MiB (1-16, default 4)."), N_("MIB"), ARG_TYPE_INT},
+    {"sparse", 's', 0, N_("Don't write the sectors which are all zeros, the target must be zeroed."), 0, 0},
+    {"checkpoint", 'c', 0, N_("Record the progress in FILE, which must exist and be at least 512 bytes."), N_("FILE"), ARG_TYPE_STRING},
+    {"resume", 'r', 0, N_("Continue the copy recorded in the checkpoint file."), 0, 0},
+    {"verify", 'v', 0, N_("Read back every chunk from the target and report the sectors which differ."), 0, 0},
+    {"hash", 'h', 0, N_("Only read the source and print its CRC32C."), 0, 0},
+    {"continue-on-error", 'e', 0, N_("Copy the sectors which can't be read as zeros, and list them at the end."), 0, 0},
+    {"skip", 'i', 0, N_("Skip N sectors at the start of the source."), N_("N"), ARG_TYPE_INT},
+    {"seek", 'o', 0, N_("Skip N sectors at the start of the targets."), N_("N"), ARG_TYPE_INT},
+    {"count", 'l', 0, N_("Copy only N sectors."), N_("N"), ARG_TYPE_INT},
+    {"raid", 'R', 0, N_("Read the source as a RAID array of this level (0, 1 or 5) assembled from the members."), N_("LEVEL"), ARG_TYPE_INT},
+    {"member", 'm', GRUB_ARG_OPTION_REPEATABLE, N_("A member of the array, in order, or \"missing\"."), N_("DEVICE"), ARG_TYPE_STRING},
+    {"stripe", 'S', 0, N_("Size of a chunk of the array in KiB (default 64)."), N_("KIB"), ARG_TYPE_INT},
+    {"layout", 'L', 0, N_("Parity layout of RAID5: left-symmetric (default), left-asymmetric, right-symmetric or right-asymmetric."), N_("LAYOUT"), ARG_TYPE_STRING},
+    {0, 0, 0, 0, 0, 0}
+  };
+
+enum options
+  {
+    RAIDDUMP_BUFFER,
+    RAIDDUMP_SPARSE,
+    RAIDDUMP_CHECKPOINT,
+    RAIDDUMP_RESUME,
+    RAIDDUMP_VERIFY,
+    RAIDDUMP_HASH,
+    RAIDDUMP_CONTINUE,
+    RAIDDUMP_SKIP,
+    RAIDDUMP_SEEK,
+    RAIDDUMP_COUNT,
+    RAIDDUMP_RAID,
+    RAIDDUMP_MEMBER,
+    RAIDDUMP_STRIPE,
+    RAIDDUMP_LAYOUT,
+  };
+
+/* A chunk on its way from the source to the target */
+struct raiddump_buffer
+{
+  char *data;
+  grub_disk_addr_t sector;
+  grub_uint64_t count;
+
+  /* Sectors read before the first bad one */
+  grub_uint64_t good;
+
+  /* Why the read stopped at GOOD, raised once those sectors are copied */
+  grub_err_t err;
+};
+
+/* The sectors copied, and where they go */
+struct raiddump_copy
+{
+  grub_uint64_t source_size;
+
+  /* The source sectors from START to END go to SEEK and after, on every
+     target */
+  grub_disk_addr_t start;
+  grub_disk_addr_t end;
+  grub_disk_addr_t seek;
+
+  grub_disk_t targets[RAIDDUMP_TARGETS_MAX];
+  int ntargets;
+};
+
+/*
+ * An array assembled from its members, for the arrays GRUB can't assemble
+ * itself. Those with metadata diskfilter knows are disks of their own, like
+ * (md/0), and are copied as any other disk. Missing members are NULL.
+ */
+struct raiddump_array
+{
+  int level;
+  int layout;
+
+  /* Size of a chunk on a member, in sectors */
+  grub_uint64_t stripe;
+
+  grub_disk_t members[RAIDDUMP_MEMBERS_MAX];
+  int nmembers;
+
+  /* Members holding data in every row */
+  int ndata;
+
+  /* Size of the array, in sectors */
+  grub_uint64_t size;
+
+  /* The biggest read, a buffer per member for it, and a chunk to rebuild
+     from */
+  grub_uint64_t max_count;
+  char *staging[RAIDDUMP_MEMBERS_MAX];
+  char *scratch;
+
+  char name[16];
+};
+
+/* Where the copy reads from, a disk or an array */
+struct raiddump_source
+{
+  grub_disk_t disk;
+  struct raiddump_array *array;
+};
+
+/* A run of sectors which couldn't be read */
+struct raiddump_range
+{
+  grub_disk_addr_t start;
+  grub_uint64_t count;
+};
+
+/* The unreadable sectors, in order. Adjacent ones share a range */
+struct raiddump_badlist
+{
+  struct raiddump_range *ranges;
+  grub_size_t nranges;
+  grub_size_t size;
+  grub_uint64_t sectors;
+};
+
+/*
+ * The buffers form a ring. Reads run ahead of the writes into every free
+ * buffer, and the oldest buffer is written next. The disk layer only has
+ * blocking reads, so a read is over when it is started here and the ring
+ * holds RAIDDUMP_BUFFERS; this is the place a non-blocking read would be
+ * started and the write of the oldest buffer would overlap it.
+ */
+struct raiddump_pipeline
+{
+  struct raiddump_buffer *buffers;
+  unsigned int nbuffers;
+  unsigned int head;
+  unsigned int nfull;
+
+  /* Size of a chunk, in sectors */
+  grub_uint64_t chunk_len;
+
+  /* The next sector to read, and the end of the copy */
+  grub_disk_addr_t next;
+  grub_disk_addr_t end;
+
+  /* Nothing is read past a bad sector */
+  int read_failed;
+
+  /* When set, bad sectors are recorded here and read as zeros instead */
+  struct raiddump_badlist *bad;
+};
+
+struct raiddump_progress
+{
+  grub_uint64_t start_ms;
+  grub_uint64_t last_ms;
+
+  /* The first sector of the copy, which the others are counted from */
+  grub_disk_addr_t origin;
+
+  /* The sector this run started at, the one it has reached, and the end */
+  grub_disk_addr_t start;
+  grub_disk_addr_t done;
+  grub_disk_addr_t end;
+};
+
+/* The checkpoint record, in the first sector of the checkpoint file. All the
+   fields are little-endian */
+struct raiddump_checkpoint_record
+{
+  char magic[8];
+
+  /* The copy the record belongs to */
+  grub_uint64_t source_size;
+  grub_uint64_t start;
+  grub_uint64_t end;
+  grub_uint64_t seek;
+
+  /* Every sector before NEXT is copied. The last chunk copied runs from LAST
+     to NEXT, LAST_CRC is its checksum as it was read */
+  grub_uint64_t next;
+  grub_uint64_t last;
+  grub_uint32_t last_crc;
+
+  /* Checksum of the fields above */
+  grub_uint32_t crc;
+} GRUB_PACKED;
+
+/*
+ * GRUB can't write files, so the checkpoint file is overwritten in place,
+ * the way save_env does it: the sector the file starts at is caught while
+ * the file is read, and written through the disk layer.
+ */
+struct raiddump_checkpoint
+{
+  grub_file_t file;
+
+  /* The first sector of the file, relative to the partition */
+  grub_disk_addr_t sector;
+
+  /* 1 when the file starts at a whole sector, -1 when it doesn't */
+  int found;
+
+  struct raiddump_checkpoint_record record;
+};
+
+static grub_err_t
+badlist_add (struct raiddump_badlist *l, grub_disk_addr_t sector)
+{
+  struct raiddump_range *r;
+
+  if ( l->nranges && l->ranges[l->nranges - 1].start + l->ranges[l->nranges - 1].count == sector )
+    {
+      l->ranges[l->nranges - 1].count++;
+      l->sectors++;
+      return GRUB_ERR_NONE;
+    }
+
+  if ( l->nranges == l->size )
+    {
+      grub_size_t size = l->size ? l->size * 2 : 16;
+
+      r = grub_realloc (l->ranges, size * sizeof (r[0]));
+      if ( ! r )
+        return grub_errno;
+
+      l->ranges = r;
+      l->size = size;
+    }
+
+  r = &l->ranges[l->nranges++];
+  r->start = sector;
+  r->count = 1;
+  l->sectors++;
+
+  return GRUB_ERR_NONE;
+}
+
+static void
+badlist_print (struct raiddump_badlist *l)
+{
+  grub_size_t k;
+
+  grub_printf (N_("Unreadable: %llu sectors in %llu ranges\n"),
+               (unsigned long long)l->sectors, (unsigned long long)l->nranges);
+
+  for ( k = 0; k < l->nranges && k < RAIDDUMP_BAD_PRINT_MAX; k++ )
+    grub_printf ("  %llu-%llu\n", (unsigned long long)l->ranges[k].start,
+                 (unsigned long long)(l->ranges[k].start + l->ranges[k].count - 1));
+
+  if ( l->nranges > RAIDDUMP_BAD_PRINT_MAX )
+    grub_printf ("  ...\n");
+}
+
+/* Open the device NAME, given as "(hd0)". WHAT says which one it is in the
+   errors */
+static grub_disk_t
+open_device (const char *name, const char *what)
+{
+  grub_size_t len = grub_strlen (name);
+  char *devname;
+  grub_disk_t disk;
+
+  if ( ! grub_strcmp (name, "(mem)") )
+    {
+      grub_error (GRUB_ERR_BAD_DEVICE, N_("memory devices aren't supported"));
+      return NULL;
+    }
+
+  if ( (len < 3) || (name[0] != '(') || (name[len - 1] != ')') )
+    {
+      grub_error (GRUB_ERR_BAD_ARGUMENT, N_("filename of a device expected (%s)"), what);
+      return NULL;
+    }
+
+  devname = grub_strndup (name + 1, len - 2);
+  if ( ! devname )
+    return NULL;
+
+  disk = grub_disk_open (devname);
+  grub_free (devname);
+
+  return disk;
+}
+
+/* The mapping of the chunks of a RAID5 array, the order is the one md
+   numbers them in */
+static const char *const raid5_layouts[] =
+  {
+    "left-asymmetric",
+    "right-asymmetric",
+    "left-symmetric",
+    "right-symmetric",
+  };
+
+#define RAIDDUMP_LEFT_ASYMMETRIC 0
+#define RAIDDUMP_RIGHT_ASYMMETRIC 1
+#define RAIDDUMP_LEFT_SYMMETRIC 2
+#define RAIDDUMP_RIGHT_SYMMETRIC 3
+
+/* XOR LEN bytes of SRC into DST. Both hold whole sectors and are aligned */
+static void
+xor_sectors (char *dst, const char *src, grub_size_t len)
+{
+  grub_addr_t *d = (grub_addr_t *) dst;
+  const grub_addr_t *s = (const grub_addr_t *) src;
+  grub_size_t n = len / sizeof (*d);
+
+  while ( n-- )
+    *d++ ^= *s++;
+}
+
+/* The member holding the data chunk CHUNK of the array, and its row */
+static int
+array_map (struct raiddump_array *a, grub_uint64_t chunk, grub_uint64_t *row)
+{
+  grub_uint64_t rem;
+  int dd, pd;
+
+  *row = grub_divmod64 (chunk, a->ndata, &rem);
+  dd = rem;
+  if ( a->level == 0 )
+    return dd;
+
+  grub_divmod64 (*row, a->nmembers, &rem);
+  switch ( a->layout )
+    {
+    case RAIDDUMP_LEFT_ASYMMETRIC:
+      pd = a->nmembers - 1 - rem;
+      return dd >= pd ? dd + 1 : dd;
+
+    case RAIDDUMP_RIGHT_ASYMMETRIC:
+      pd = rem;
+      return dd >= pd ? dd + 1 : dd;
+
+    case RAIDDUMP_LEFT_SYMMETRIC:
+      pd = a->nmembers - 1 - rem;
+      return (pd + 1 + dd) % a->nmembers;
+
+    default:
+      pd = rem;
+      return (pd + 1 + dd) % a->nmembers;
+    }
+}
+
+/* Rebuild the LEN sectors at SECTOR of member K from the other members */
+static grub_err_t
+array_rebuild (struct raiddump_array *a, int k, grub_disk_addr_t sector, grub_uint64_t len, char *buf)
+{
+  int j;
+
+  grub_memset (buf, 0, len << GRUB_DISK_SECTOR_BITS);
+  for ( j = 0; j < a->nmembers; j++ )
+    {
+      if ( j == k )
+        continue;
+
+      if ( ! a->members[j] )
+        return grub_error (GRUB_ERR_BAD_DEVICE, N_("two members of the array failed"));
+
+      if ( grub_disk_read (a->members[j], sector, 0, len << GRUB_DISK_SECTOR_BITS, a->scratch)
+           != GRUB_ERR_NONE )
+        return grub_errno;
+
+      xor_sectors (buf, a->scratch, len << GRUB_DISK_SECTOR_BITS);
+    }
+
+  return GRUB_ERR_NONE;
+}
+
+/* Read COUNT sectors of a mirror, from the first member which can */
+static grub_err_t
+mirror_read (struct raiddump_array *a, grub_disk_addr_t sector, grub_uint64_t count, char *buf)
+{
+  grub_err_t err = GRUB_ERR_BAD_DEVICE;
+  int k;
+
+  for ( k = 0; k < a->nmembers; k++ )
+    {
+      if ( ! a->members[k] )
+        continue;
+
+      if ( grub_disk_read (a->members[k], sector, 0, count << GRUB_DISK_SECTOR_BITS, buf) == GRUB_ERR_NONE )
+        return GRUB_ERR_NONE;
+
+      err = grub_errno;
+      grub_errno = GRUB_ERR_NONE;
+    }
+
+  return grub_error (err, N_("no member can read sector %llu"), (unsigned long long)sector);
+}
+
+/*
+ * Read COUNT sectors of a striped array, at most MAX_COUNT. Every member is
+ * read once, in one piece covering all its chunks in the range, and the
+ * chunks are put in order from there. A chunk of a member which is missing
+ * or can't be read is rebuilt from the parity, chunk by chunk.
+ */
+static grub_err_t
+stripe_read (struct raiddump_array *a, grub_disk_addr_t sector, grub_uint64_t count, char *buf)
+{
+  grub_disk_addr_t lo[RAIDDUMP_MEMBERS_MAX], hi[RAIDDUMP_MEMBERS_MAX];
+  grub_disk_addr_t s, end = sector + count;
+  grub_err_t failed[RAIDDUMP_MEMBERS_MAX];
+  grub_uint64_t off, row, len;
+  int k, nfailed = 0;
+  grub_err_t err = GRUB_ERR_NONE;
+
+  for ( k = 0; k < a->nmembers; k++ )
+    {
+      lo[k] = ~(grub_disk_addr_t) 0;
+      hi[k] = 0;
+      failed[k] = a->members[k] ? GRUB_ERR_NONE : GRUB_ERR_BAD_DEVICE;
+    }
+
+  /* the span of every member the range needs */
+  for ( s = sector; s < end; s += len )
+    {
+      k = array_map (a, grub_divmod64 (s, a->stripe, &off), &row);
+      len = a->stripe - off;
+      if ( len > end - s )
+        len = end - s;
+
+      if ( row * a->stripe + off < lo[k] )
+        lo[k] = row * a->stripe + off;
+      if ( row * a->stripe + off + len > hi[k] )
+        hi[k] = row * a->stripe + off + len;
+    }
+
+  for ( k = 0; k < a->nmembers; k++ )
+    {
+      if ( hi[k] <= lo[k] || failed[k] )
+        continue;
+
+      if ( grub_disk_read (a->members[k], lo[k], 0, (hi[k] - lo[k]) << GRUB_DISK_SECTOR_BITS, a->staging[k])
+           != GRUB_ERR_NONE )
+        {
+          failed[k] = grub_errno;
+          grub_errno = GRUB_ERR_NONE;
+        }
+    }
+
+  for ( k = 0; k < a->nmembers; k++ )
+    if ( hi[k] > lo[k] && failed[k] )
+      {
+        err = failed[k];
+        nfailed++;
+      }
+
+  if ( nfailed > (a->level == 5 ? 1 : 0) )
+    return grub_error (err, N_("can't read sectors %llu-%llu of the array"),
+                       (unsigned long long)sector, (unsigned long long)(end - 1));
+
+  for ( s = sector; s < end; s += len )
+    {
+      char *dst = buf + ((s - sector) << GRUB_DISK_SECTOR_BITS);
+      grub_disk_addr_t ms;
+
+      k = array_map (a, grub_divmod64 (s, a->stripe, &off), &row);
+      len = a->stripe - off;
+      if ( len > end - s )
+        len = end - s;
+      ms = row * a->stripe + off;
+
+      if ( ! failed[k] )
+        grub_memcpy (dst, a->staging[k] + ((ms - lo[k]) << GRUB_DISK_SECTOR_BITS),
+                     len << GRUB_DISK_SECTOR_BITS);
+      else if ( array_rebuild (a, k, ms, len, dst) != GRUB_ERR_NONE )
+        return grub_errno;
+    }
+
+  return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+array_read (struct raiddump_array *a, grub_disk_addr_t sector, grub_uint64_t count, char *buf)
+{
+  while ( count )
+    {
+      grub_uint64_t n = count;
+
+      if ( n > a->max_count )
+        n = a->max_count;
+
+      if ( (a->level == 1 ? mirror_read (a, sector, n, buf) : stripe_read (a, sector, n, buf))
+           != GRUB_ERR_NONE )
+        return grub_errno;
+
+      sector += n;
+      buf += n << GRUB_DISK_SECTOR_BITS;
+      count -= n;
+    }
+
+  return GRUB_ERR_NONE;
+}
+
+static void
+array_close (struct raiddump_array *a)
+{
+  int k;
+
+  for ( k = 0; k < a->nmembers; k++ )
+    {
+      if ( a->members[k] )
+        grub_disk_close (a->members[k]);
+      grub_free (a->staging[k]);
+    }
+
+  grub_free (a->scratch);
+  grub_memset (a, 0, sizeof (*a));
+}
+
+/* Assemble the array of LEVEL from the members NAMES, "missing" for a member
+   which is gone. STRIPE is the size of a chunk and MAX_COUNT the biggest read,
+   in sectors */
+static grub_err_t
+array_open (struct raiddump_array *a, int level, grub_uint64_t stripe, int layout,
+            char **names, grub_uint64_t max_count)
+{
+  grub_uint64_t member_size = GRUB_DISK_SIZE_UNKNOWN;
+  grub_uint64_t rows, staging_len;
+  int k, nmissing = 0;
+
+  grub_memset (a, 0, sizeof (*a));
+  a->level = level;
+  a->layout = layout;
+  a->stripe = stripe;
+  a->max_count = max_count;
+  grub_snprintf (a->name, sizeof (a->name), "raid%d", level);
+
+  for ( ; names[a->nmembers]; a->nmembers++ )
+    {
+      if ( a->nmembers == RAIDDUMP_MEMBERS_MAX )
+        {
+          array_close (a);
+          return grub_error (GRUB_ERR_BAD_ARGUMENT, N_("too many members"));
+        }
+
+      if ( ! grub_strcmp (names[a->nmembers], "missing") )
+        {
+          nmissing++;
+          continue;
+        }
+
+      a->members[a->nmembers] = open_device (names[a->nmembers], "member");
+      if ( ! a->members[a->nmembers] )
+        {
+          array_close (a);
+          return grub_errno;
+        }
+
+      if ( grub_disk_get_size (a->members[a->nmembers]) < member_size )
+        member_size = grub_disk_get_size (a->members[a->nmembers]);
+    }
+
+  if ( (level == 0 && (a->nmembers < 2 || nmissing))
+       || (level == 1 && nmissing == a->nmembers)
+       || (level == 5 && (a->nmembers < 3 || nmissing > 1)) )
+    {
+      array_close (a);
+      return grub_error (GRUB_ERR_BAD_ARGUMENT, N_("not enough members for RAID%d"), level);
+    }
+
+  if ( member_size == GRUB_DISK_SIZE_UNKNOWN )
+    {
+      array_close (a);
+      return grub_error (GRUB_ERR_BAD_DEVICE, N_("size of a member device is unknown"));
+    }
+
+  if ( level == 1 )
+    {
+      a->size = member_size;
+      return GRUB_ERR_NONE;
+    }
+
+  /* the chunks past the last whole row aren't part of the array */
+  a->ndata = level == 5 ? a->nmembers - 1 : a->nmembers;
+  rows = grub_divmod64 (member_size, stripe, NULL);
+  a->size = rows * stripe * a->ndata;
+
+  /* the rows a read of MAX_COUNT sectors touches, partial ones at both ends */
+  staging_len = (grub_divmod64 (max_count, stripe * a->ndata, NULL) + 3) * stripe;
+  for ( k = 0; k < a->nmembers; k++ )
+    {
+      if ( ! a->members[k] )
+        continue;
+
+      a->staging[k] = grub_memalign (RAIDDUMP_BUFFER_ALIGN, staging_len << GRUB_DISK_SECTOR_BITS);
+      if ( ! a->staging[k] )
+        {
+          array_close (a);
+          return grub_error (GRUB_ERR_OUT_OF_MEMORY, N_("out of memory"));
+        }
+    }
+
+  a->scratch = grub_memalign (RAIDDUMP_BUFFER_ALIGN, stripe << GRUB_DISK_SECTOR_BITS);
+  if ( ! a->scratch )
+    {
+      array_close (a);
+      return grub_error (GRUB_ERR_OUT_OF_MEMORY, N_("out of memory"));
+    }
+
+  return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+source_read (struct raiddump_source *src, grub_disk_addr_t sector, grub_uint64_t count, char *buf)
+{
+  if ( src->array )
+    return array_read (src->array, sector, count, buf);
+
+  return grub_disk_read (src->disk, sector, 0, count << GRUB_DISK_SECTOR_BITS, buf);
+}
+
+/* Read the sector at SECTOR into BUF, trying up to TRIES times */
+static grub_err_t
+read_sector (struct raiddump_source *src, grub_disk_addr_t sector, char *buf, int tries)
+{
+  while ( source_read (src, sector, 1, buf) != GRUB_ERR_NONE )
+    {
+      if ( --tries <= 0 )
+        return grub_errno;
+
+      grub_errno = GRUB_ERR_NONE;
+    }
+
+  return GRUB_ERR_NONE;
+}
+
+/* Read COUNT sectors at SECTOR into BUF. When the whole chunk can't be read,
+   read it in pieces, and the pieces which fail sector by sector, to find the
+   bad sectors. Returns the number of sectors read before the first bad one.
+   The error of the bad sector goes to ERR, and grub_errno is left clear so
+   the caller can still write the sectors before it. With BAD, the bad
+   sectors are recorded in it and zeroed in BUF instead, and the read goes
+   on */
+static grub_uint64_t
+read_chunk (struct raiddump_source *src, grub_disk_addr_t sector, grub_uint64_t count, char *buf,
+            struct raiddump_badlist *bad, grub_err_t *err)
+{
+  grub_uint64_t i, j, n;
+
+  *err = GRUB_ERR_NONE;
+
+  if ( source_read (src, sector, count, buf) == GRUB_ERR_NONE )
+    return count;
+
+  grub_errno = GRUB_ERR_NONE;
+  for ( i = 0; i < count; i += n )
+    {
+      n = count - i;
+      if ( n > RAIDDUMP_PIECE_LEN )
+        n = RAIDDUMP_PIECE_LEN;
+
+      if ( source_read (src, sector + i, n, buf + (i << GRUB_DISK_SECTOR_BITS)) == GRUB_ERR_NONE )
+        continue;
+
+      grub_errno = GRUB_ERR_NONE;
+      for ( j = i; j < i + n; j++ )
+        {
+          char *s = buf + (j << GRUB_DISK_SECTOR_BITS);
+
+          if ( read_sector (src, sector + j, s, bad ? RAIDDUMP_RETRIES : 1) == GRUB_ERR_NONE )
+            continue;
+
+          if ( ! bad || badlist_add (bad, sector + j) != GRUB_ERR_NONE )
+            {
+              *err = grub_errno;
+              grub_errno = GRUB_ERR_NONE;
+              return j;
+            }
+
+          grub_memset (s, 0, GRUB_DISK_SECTOR_SIZE);
+          grub_errno = GRUB_ERR_NONE;
+        }
+    }
+
+  return count;
+}
+
+/* Whether the sector at BUF is all zeros. BUF is aligned, so it is scanned a
+   word at a time, four words per step */
+static int
+sector_is_zero (const char *buf)
+{
+  const grub_addr_t *w = (const grub_addr_t *) buf;
+  const grub_addr_t *end = w + GRUB_DISK_SECTOR_SIZE / sizeof (*w);
+
+  for ( ; w < end; w += 4 )
+    if ( w[0] | w[1] | w[2] | w[3] )
+      return 0;
+
+  return 1;
+}
+
+/* Where the source sector SECTOR goes on the targets */
+static grub_disk_addr_t
+target_sector (const struct raiddump_copy *copy, grub_disk_addr_t sector)
+{
+  return sector - copy->start + copy->seek;
+}
+
+/* Write the sectors of B which were read at SECTOR. In sparse mode the runs
+   of sectors which are all zeros are left alone, and counted in SKIPPED */
 static grub_err_t
-grub_cmd_raiddump (grub_command_t cmd __attribute__ ((unused)), int argc, char **args)
+write_buffer (grub_disk_t disk, grub_disk_addr_t sector, struct raiddump_buffer *b, int sparse,
+              grub_uint64_t *skipped)
+{
+  grub_uint64_t start, j;
+
+  if ( ! sparse )
+    {
+      if ( ! b->good )
+        return GRUB_ERR_NONE;
+
+      return grub_disk_write (disk, sector, 0, b->good << GRUB_DISK_SECTOR_BITS, b->data);
+    }
+
+  start = 0;
+  for ( j = 0; j <= b->good; j++ )
+    {
+      if ( j < b->good && ! sector_is_zero (b->data + (j << GRUB_DISK_SECTOR_BITS)) )
+        continue;
+
+      /* write the run of data before this zero sector, or the end */
+      if ( j > start
+           && grub_disk_write (disk, sector + start, 0, (j - start) << GRUB_DISK_SECTOR_BITS,
+                               b->data + (start << GRUB_DISK_SECTOR_BITS)) != GRUB_ERR_NONE )
+        return grub_errno;
+
+      if ( j < b->good )
+        *skipped += GRUB_DISK_SECTOR_SIZE;
+      start = j + 1;
+    }
+
+  return GRUB_ERR_NONE;
+}
+
+/* Write B to every target. The zeros skipped are the same on all of them */
+static grub_err_t
+write_targets (struct raiddump_copy *copy, struct raiddump_buffer *b, int sparse, grub_uint64_t *skipped)
+{
+  int k;
+
+  for ( k = 0; k < copy->ntargets; k++ )
+    {
+      *skipped = 0;
+      if ( write_buffer (copy->targets[k], target_sector (copy, b->sector), b, sparse, skipped)
+           != GRUB_ERR_NONE )
+        return grub_errno;
+    }
+
+  return GRUB_ERR_NONE;
+}
+
+static void
+pipeline_free (struct raiddump_pipeline *p)
+{
+  unsigned int k;
+
+  if ( p->buffers )
+    for ( k = 0; k < p->nbuffers; k++ )
+      grub_free (p->buffers[k].data);
+
+  grub_free (p->buffers);
+}
+
+static grub_err_t
+pipeline_init (struct raiddump_pipeline *p, unsigned int nbuffers, grub_uint64_t chunk_len,
+               grub_disk_addr_t start, grub_disk_addr_t end)
+{
+  unsigned int k;
+
+  grub_memset (p, 0, sizeof (*p));
+  p->nbuffers = nbuffers;
+  p->chunk_len = chunk_len;
+  p->next = start;
+  p->end = end;
+
+  p->buffers = grub_zalloc (nbuffers * sizeof (p->buffers[0]));
+  if ( ! p->buffers )
+    return grub_errno;
+
+  for ( k = 0; k < nbuffers; k++ )
+    {
+      p->buffers[k].data = grub_memalign (RAIDDUMP_BUFFER_ALIGN, chunk_len << GRUB_DISK_SECTOR_BITS);
+      if ( ! p->buffers[k].data )
+        {
+          pipeline_free (p);
+          return grub_error (GRUB_ERR_OUT_OF_MEMORY, N_("out of memory"));
+        }
+    }
+
+  return GRUB_ERR_NONE;
+}
+
+/* Start reading into every free buffer */
+static void
+pipeline_fill (struct raiddump_pipeline *p, struct raiddump_source *src)
+{
+  while ( p->nfull < p->nbuffers && p->next < p->end && ! p->read_failed )
+    {
+      struct raiddump_buffer *b = &p->buffers[(p->head + p->nfull) % p->nbuffers];
+
+      b->sector = p->next;
+      b->count = p->end - p->next;
+      if ( b->count > p->chunk_len )
+        b->count = p->chunk_len;
+
+      /* the sectors before a read error are still copied */
+      b->good = read_chunk (src, b->sector, b->count, b->data, p->bad, &b->err);
+      if ( b->good != b->count )
+        p->read_failed = 1;
+
+      p->next += b->count;
+      p->nfull++;
+    }
+}
+
+/* The oldest buffer, once its read is over. NULL when all is copied */
+static struct raiddump_buffer *
+pipeline_next (struct raiddump_pipeline *p, struct raiddump_source *src)
+{
+  pipeline_fill (p, src);
+
+  if ( ! p->nfull )
+    return NULL;
+
+  return &p->buffers[p->head];
+}
+
+/* Give the oldest buffer back for reading */
+static void
+pipeline_release (struct raiddump_pipeline *p)
+{
+  p->head = (p->head + 1) % p->nbuffers;
+  p->nfull--;
+}
+
+static void
+checkpoint_read_hook (grub_disk_addr_t sector, unsigned offset, unsigned length, void *data)
+{
+  struct raiddump_checkpoint *c = data;
+
+  if ( c->found )
+    return;
+
+  c->found = ( offset == 0 && length == GRUB_DISK_SECTOR_SIZE ) ? 1 : -1;
+  c->sector = sector;
+}
+
+static void
+checkpoint_close (struct raiddump_checkpoint *c)
+{
+  if ( c->file )
+    grub_file_close (c->file);
+  c->file = NULL;
+}
+
+static grub_uint32_t
+record_crc (const struct raiddump_checkpoint_record *r)
+{
+  return grub_getcrc32c (0, r, sizeof (*r) - sizeof (r->crc));
+}
+
+/* Open the checkpoint file NAME and read the record in it */
+static grub_err_t
+checkpoint_open (struct raiddump_checkpoint *c, const char *name)
+{
+  char buf[GRUB_DISK_SECTOR_SIZE];
+  grub_disk_t disk;
+
+  grub_memset (c, 0, sizeof (*c));
+  c->file = grub_file_open (name, GRUB_FILE_TYPE_SAVEENV | GRUB_FILE_TYPE_NO_DECOMPRESS);
+  if ( ! c->file )
+    return grub_errno;
+
+  disk = c->file->device->disk;
+  if ( ! disk )
+    {
+      checkpoint_close (c);
+      return grub_error (GRUB_ERR_BAD_DEVICE, N_("checkpoint file must be on a disk"));
+    }
+
+  if ( grub_file_size (c->file) < GRUB_DISK_SECTOR_SIZE )
+    {
+      checkpoint_close (c);
+      return grub_error (GRUB_ERR_BAD_FILE_TYPE, N_("checkpoint file is too small"));
+    }
+
+  c->file->read_hook = checkpoint_read_hook;
+  c->file->read_hook_data = c;
+  if ( grub_file_read (c->file, buf, sizeof (buf)) != sizeof (buf) )
+    {
+      checkpoint_close (c);
+      if ( ! grub_errno )
+        grub_error (GRUB_ERR_FILE_READ_ERROR, N_("premature end of file %s"), name);
+      return grub_errno;
+    }
+  c->file->read_hook = NULL;
+
+  if ( c->found != 1 )
+    {
+      checkpoint_close (c);
+      return grub_error (GRUB_ERR_BAD_FILE_TYPE, N_("checkpoint file can't be written in place"));
+    }
+
+  c->sector -= grub_partition_get_start (disk->partition);
+  grub_memcpy (&c->record, buf, sizeof (c->record));
+
+  return GRUB_ERR_NONE;
+}
+
+/* Record that the chunk from LAST to NEXT, with checksum LAST_CRC, is copied */
+static grub_err_t
+checkpoint_save (struct raiddump_checkpoint *c, struct raiddump_copy *copy,
+                 grub_disk_addr_t last, grub_disk_addr_t next, grub_uint32_t last_crc)
 {
   char buf[GRUB_DISK_SECTOR_SIZE];
-  int namelen_in, namelen_out;
-  char *filename_in, *filename_out;
+  struct raiddump_checkpoint_record *r = &c->record;
+
+  grub_memcpy (r->magic, RAIDDUMP_CHECKPOINT_MAGIC, sizeof (r->magic));
+  r->source_size = grub_cpu_to_le64 (copy->source_size);
+  r->start = grub_cpu_to_le64 (copy->start);
+  r->end = grub_cpu_to_le64 (copy->end);
+  r->seek = grub_cpu_to_le64 (copy->seek);
+  r->next = grub_cpu_to_le64 (next);
+  r->last = grub_cpu_to_le64 (last);
+  r->last_crc = grub_cpu_to_le32 (last_crc);
+  r->crc = grub_cpu_to_le32 (record_crc (r));
+
+  grub_memset (buf, 0, sizeof (buf));
+  grub_memcpy (buf, r, sizeof (*r));
+
+  return grub_disk_write (c->file->device->disk, c->sector, 0, sizeof (buf), buf);
+}
+
+/* The checksum of the sectors from FIRST to END of the target DISK */
+static grub_err_t
+target_crc (grub_disk_t disk, grub_disk_addr_t first, grub_disk_addr_t end, char *buf,
+            grub_uint32_t *crc)
+{
+  grub_disk_addr_t s;
+
+  *crc = 0;
+  for ( s = first; s < end; s += RAIDDUMP_CHECK_LEN )
+    {
+      grub_uint64_t count = end - s;
+
+      if ( count > RAIDDUMP_CHECK_LEN )
+        count = RAIDDUMP_CHECK_LEN;
+
+      if ( grub_disk_read (disk, s, 0, count << GRUB_DISK_SECTOR_BITS, buf) != GRUB_ERR_NONE )
+        return grub_errno;
+
+      *crc = grub_getcrc32c (*crc, buf, count << GRUB_DISK_SECTOR_BITS);
+    }
+
+  return GRUB_ERR_NONE;
+}
+
+/* Find where to continue the copy recorded in C. The last chunk recorded is
+   read back from every target, and copied again when it doesn't match */
+static grub_err_t
+checkpoint_resume (struct raiddump_checkpoint *c, struct raiddump_copy *copy, grub_disk_addr_t *start)
+{
+  struct raiddump_checkpoint_record *r = &c->record;
+  grub_disk_addr_t last, next;
+  grub_uint32_t crc;
+  char *buf;
+  int k;
+
+  if ( grub_memcmp (r->magic, RAIDDUMP_CHECKPOINT_MAGIC, sizeof (r->magic))
+       || grub_le_to_cpu32 (r->crc) != record_crc (r) )
+    return grub_error (GRUB_ERR_BAD_FILE_TYPE, N_("no valid checkpoint record"));
+
+  last = grub_le_to_cpu64 (r->last);
+  next = grub_le_to_cpu64 (r->next);
+  if ( grub_le_to_cpu64 (r->source_size) != copy->source_size || grub_le_to_cpu64 (r->start) != copy->start
+       || grub_le_to_cpu64 (r->end) != copy->end || grub_le_to_cpu64 (r->seek) != copy->seek )
+    return grub_error (GRUB_ERR_BAD_ARGUMENT, N_("checkpoint record is for another copy"));
+
+  if ( last < copy->start || last > next || next > copy->end )
+    return grub_error (GRUB_ERR_BAD_FILE_TYPE, N_("no valid checkpoint record"));
+
+  buf = grub_malloc (RAIDDUMP_CHECK_LEN << GRUB_DISK_SECTOR_BITS);
+  if ( ! buf )
+    return grub_errno;
+
+  *start = next;
+  for ( k = 0; k < copy->ntargets; k++ )
+    {
+      if ( target_crc (copy->targets[k], target_sector (copy, last), target_sector (copy, next), buf, &crc)
+           != GRUB_ERR_NONE )
+        {
+          grub_free (buf);
+          return grub_errno;
+        }
+
+      if ( crc != grub_le_to_cpu32 (r->last_crc) )
+        {
+          grub_printf (N_("The last chunk on %s doesn't match, copying it again\n"), copy->targets[k]->name);
+          *start = last;
+        }
+    }
+  grub_free (buf);
+
+  grub_printf (N_("Resuming at sector %llu\n"), (unsigned long long)*start);
+  return GRUB_ERR_NONE;
+}
+
+static void
+progress_init (struct raiddump_progress *pr, grub_disk_addr_t origin, grub_disk_addr_t start,
+               grub_disk_addr_t end)
+{
+  pr->start_ms = pr->last_ms = grub_get_time_ms ();
+  pr->origin = origin;
+  pr->start = pr->done = start - origin;
+  pr->end = end - origin;
+}
+
+/* The rate since the start, in bytes per millisecond, which is kB/s */
+static unsigned long
+progress_rate (struct raiddump_progress *pr, grub_uint64_t now)
+{
+  grub_uint64_t elapsed = now - pr->start_ms;
+
+  if ( ! elapsed )
+    elapsed = 1;
+
+  return grub_divmod64 ((pr->done - pr->start) << GRUB_DISK_SECTOR_BITS, elapsed, NULL);
+}
+
+/* Record that every source sector before DONE is handled, and print the
+   progress when it is time to */
+static void
+progress_update (struct raiddump_progress *pr, grub_disk_addr_t done)
+{
+  grub_uint64_t now = grub_get_time_ms ();
+  unsigned long rate, eta;
+
+  pr->done = done - pr->origin;
+  if ( now - pr->last_ms < RAIDDUMP_PROGRESS_MS )
+    return;
+
+  pr->last_ms = now;
+  rate = progress_rate (pr, now);
+  eta = 0;
+  if ( rate )
+    eta = grub_divmod64 ((pr->end - pr->done) << GRUB_DISK_SECTOR_BITS, rate * 1000ULL, NULL);
+
+  grub_printf (N_("Progress: %llu of %llu MiB, %lu.%lu MB/s, ETA %lu:%02lu:%02lu\n"),
+               (unsigned long long)(pr->done >> (20 - GRUB_DISK_SECTOR_BITS)),
+               (unsigned long long)(pr->end >> (20 - GRUB_DISK_SECTOR_BITS)),
+               rate / 1000, rate % 1000 / 100, eta / 3600, eta / 60 % 60, eta % 60);
+}
+
+static void
+progress_done (struct raiddump_progress *pr)
+{
+  grub_uint64_t now = grub_get_time_ms ();
+  unsigned long rate = progress_rate (pr, now);
+  unsigned long elapsed = grub_divmod64 (now - pr->start_ms, 1000, NULL);
+
+  grub_printf (N_("Time: %lu:%02lu:%02lu, %lu.%lu MB/s\n"),
+               elapsed / 3600, elapsed / 60 % 60, elapsed % 60, rate / 1000, rate % 1000 / 100);
+}
+
+/* Read back the sectors of B from SECTOR of a target, and check them against
+   CRC, the checksum of B. The ranges which differ are printed, and their
+   sectors counted in MISMATCHED */
+static grub_err_t
+verify_buffer (grub_disk_t disk, grub_disk_addr_t sector, struct raiddump_buffer *b, grub_uint32_t crc,
+               char *vbuf, grub_uint64_t *mismatched)
+{
+  grub_uint64_t start, j;
+  int differs = 0;
+
+  if ( ! b->good )
+    return GRUB_ERR_NONE;
+
+  if ( grub_disk_read (disk, sector, 0, b->good << GRUB_DISK_SECTOR_BITS, vbuf) != GRUB_ERR_NONE )
+    return grub_errno;
+
+  if ( grub_getcrc32c (0, vbuf, b->good << GRUB_DISK_SECTOR_BITS) == crc )
+    return GRUB_ERR_NONE;
+
+  /* the chunk is still in B, so the bad sectors can be told apart */
+  start = 0;
+  for ( j = 0; j <= b->good; j++ )
+    {
+      if ( j < b->good
+           && grub_memcmp (b->data + (j << GRUB_DISK_SECTOR_BITS), vbuf + (j << GRUB_DISK_SECTOR_BITS),
+                           GRUB_DISK_SECTOR_SIZE) )
+        {
+          if ( ! differs )
+            start = j;
+          differs = 1;
+          continue;
+        }
+
+      if ( differs )
+        {
+          grub_printf (N_("Mismatch: %s sectors %llu-%llu\n"), disk->name,
+                       (unsigned long long)(sector + start), (unsigned long long)(sector + j - 1));
+          *mismatched += j - start;
+        }
+      differs = 0;
+    }
+
+  return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+verify_targets (struct raiddump_copy *copy, struct raiddump_buffer *b, grub_uint32_t crc, char *vbuf,
+                grub_uint64_t *mismatched)
+{
+  int k;
+
+  for ( k = 0; k < copy->ntargets; k++ )
+    if ( verify_buffer (copy->targets[k], target_sector (copy, b->sector), b, crc, vbuf, mismatched)
+         != GRUB_ERR_NONE )
+      return grub_errno;
+
+  return GRUB_ERR_NONE;
+}
+
+/* Parse ARG, the number of sectors given to option NAME */
+static grub_err_t
+parse_sectors (const char *arg, const char *name, grub_uint64_t *val)
+{
+  const char *end;
+
+  *val = grub_strtoull (arg, &end, 0);
+  if ( grub_errno || *end )
+    return grub_error (GRUB_ERR_BAD_ARGUMENT, N_("invalid number of sectors for --%s"), name);
+
+  return GRUB_ERR_NONE;
+}
+
+/* Read the whole source and print its checksum */
+static grub_err_t
+hash_device (struct raiddump_pipeline *p, struct raiddump_source *src, struct raiddump_progress *pr)
+{
+  struct raiddump_buffer *b;
+  grub_uint64_t b_read = 0;
+  grub_uint32_t crc = 0;
+
+  while ( (b = pipeline_next (p, src)) != NULL )
+    {
+      crc = grub_getcrc32c (crc, b->data, b->good << GRUB_DISK_SECTOR_BITS);
+      b_read += b->good << GRUB_DISK_SECTOR_BITS;
+      progress_update (pr, b->sector + b->good);
+
+      if ( b->good != b->count )
+        {
+          grub_error (b->err, N_("can't read sector %llu"),
+                      (unsigned long long)(b->sector + b->good));
+          break;
+        }
+
+      pipeline_release (p);
+    }
+
+  grub_printf (N_("Read: %llu bytes\n"), (unsigned long long)b_read);
+  progress_done (pr);
+  if ( b )
+    return grub_errno;
+
+  grub_printf (N_("CRC32C: %08x\n"), crc);
+  return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+grub_cmd_raiddump (grub_extcmd_context_t ctxt, int argc, char **args)
+{
+  struct grub_arg_list *state = ctxt->state;
+  struct raiddump_pipeline pipeline;
+  struct raiddump_checkpoint checkpoint;
+  struct raiddump_badlist bad;
+  struct raiddump_progress progress;
+  struct raiddump_copy copy;
+  struct raiddump_source source;
+  struct raiddump_array array;
+  struct raiddump_buffer *b;
+  grub_disk_addr_t start;
+  grub_uint64_t chunk_len, count;
+  unsigned long buffer_mib = RAIDDUMP_BUFFER_DEFAULT;
+  unsigned long level = 0;
+  unsigned long stripe_kib = RAIDDUMP_STRIPE_DEFAULT;
+  int layout = RAIDDUMP_LEFT_SYMMETRIC;
+  int hash_mode = state[RAIDDUMP_HASH].set;
+  int verify = state[RAIDDUMP_VERIFY].set;
+  int raid_mode = state[RAIDDUMP_RAID].set;
+  int nsources = raid_mode ? 0 : 1;
   int dump_mode = 0;
+  int k;
+  char *vbuf = NULL;
+  grub_err_t err = GRUB_ERR_NONE;
+
+  /* an array has no SOURCE argument, its members are options */
+  if ( (argc > nsources) && ! grub_strcmp (args[argc - 1], "sample") )
+    {
+      dump_mode = 1;
+      argc--;
+    }
 
-  if ( (argc != 2) && (argc != 3) )
+  if ( hash_mode ? (argc != nsources) : (argc <= nsources || argc > nsources + RAIDDUMP_TARGETS_MAX) )
     return grub_error (GRUB_ERR_BAD_ARGUMENT, N_("wrong number of arguments"));
 
-  if ( (argc == 3) && grub_strcmp (args[2], "sample") )
-    return grub_error (GRUB_ERR_BAD_ARGUMENT, N_("unknown dump mode"));
+  if ( state[RAIDDUMP_BUFFER].set )
+    {
+      const char *end;
 
-  if ( (argc == 3) && !grub_strcmp (args[2], "sample") )
-    dump_mode = 1;
+      buffer_mib = grub_strtoul (state[RAIDDUMP_BUFFER].arg, &end, 0);
+      if ( grub_errno || *end || buffer_mib < 1 || buffer_mib > RAIDDUMP_BUFFER_MAX )
+        return grub_error (GRUB_ERR_BAD_ARGUMENT, N_("invalid buffer size"));
+    }
 
-  filename_in = grub_strdup (args[0]);
-  if (! filename_in)
-    return grub_error (GRUB_ERR_OUT_OF_MEMORY, N_("out of memory"));
+  if ( ! raid_mode && (state[RAIDDUMP_MEMBER].set || state[RAIDDUMP_STRIPE].set || state[RAIDDUMP_LAYOUT].set) )
+    return grub_error (GRUB_ERR_BAD_ARGUMENT, N_("--member, --stripe and --layout need --raid"));
 
-  filename_out = grub_strdup (args[1]);
-  if (! filename_out)
+  if ( raid_mode )
     {
-      grub_free (filename_in);
-      return grub_error (GRUB_ERR_OUT_OF_MEMORY, N_("out of memory"));
+      const char *end;
+
+      level = grub_strtoul (state[RAIDDUMP_RAID].arg, &end, 0);
+      if ( grub_errno || *end || (level != 0 && level != 1 && level != 5) )
+        return grub_error (GRUB_ERR_BAD_ARGUMENT, N_("unsupported RAID level"));
+
+      if ( state[RAIDDUMP_STRIPE].set )
+        {
+          stripe_kib = grub_strtoul (state[RAIDDUMP_STRIPE].arg, &end, 0);
+          if ( grub_errno || *end || stripe_kib < 1 || stripe_kib > RAIDDUMP_STRIPE_MAX )
+            return grub_error (GRUB_ERR_BAD_ARGUMENT, N_("invalid stripe size"));
+        }
+
+      if ( state[RAIDDUMP_LAYOUT].set )
+        {
+          for ( layout = 0; layout < (int) ARRAY_SIZE (raid5_layouts); layout++ )
+            if ( ! grub_strcmp (state[RAIDDUMP_LAYOUT].arg, raid5_layouts[layout]) )
+              break;
+
+          if ( layout == (int) ARRAY_SIZE (raid5_layouts) )
+            return grub_error (GRUB_ERR_BAD_ARGUMENT, N_("unknown layout %s"), state[RAIDDUMP_LAYOUT].arg);
+        }
+
+      if ( ! state[RAIDDUMP_MEMBER].set )
+        return grub_error (GRUB_ERR_BAD_ARGUMENT, N_("--raid needs its members"));
     }
 
-  namelen_in = grub_strlen (filename_in);
-  namelen_out = grub_strlen (filename_out);
+  grub_memset (&copy, 0, sizeof (copy));
+  if ( (state[RAIDDUMP_SKIP].set && parse_sectors (state[RAIDDUMP_SKIP].arg, "skip", &copy.start))
+       || (state[RAIDDUMP_SEEK].set && parse_sectors (state[RAIDDUMP_SEEK].arg, "seek", &copy.seek))
+       || (state[RAIDDUMP_COUNT].set && parse_sectors (state[RAIDDUMP_COUNT].arg, "count", &count)) )
+    return grub_errno;
+
+  if ( state[RAIDDUMP_COUNT].set && dump_mode )
+    return grub_error (GRUB_ERR_BAD_ARGUMENT, N_("--count and sample can't be combined"));
+
+  if ( state[RAIDDUMP_RESUME].set && ! state[RAIDDUMP_CHECKPOINT].set )
+    return grub_error (GRUB_ERR_BAD_ARGUMENT, N_("--resume needs a checkpoint file"));
+
+  if ( hash_mode && (state[RAIDDUMP_SPARSE].set || state[RAIDDUMP_CHECKPOINT].set || verify
+                     || state[RAIDDUMP_SEEK].set) )
+    return grub_error (GRUB_ERR_BAD_ARGUMENT, N_("--hash only reads the source"));
+
+  /* one firmware call moves a whole chunk, instead of a sector */
+  chunk_len = (grub_uint64_t) buffer_mib << (20 - GRUB_DISK_SECTOR_BITS);
+
+  grub_memset (&source, 0, sizeof (source));
+  if ( raid_mode )
+    {
+      if ( array_open (&array, level, (grub_uint64_t) stripe_kib << (10 - GRUB_DISK_SECTOR_BITS), layout,
+                       state[RAIDDUMP_MEMBER].args, chunk_len) != GRUB_ERR_NONE )
+        return grub_errno;
 
-  if (! grub_strcmp (filename_in, "(mem)") || ! grub_strcmp (filename_out, "(mem)") )
+      source.array = &array;
+      copy.source_size = array.size;
+    }
+  else
     {
-      grub_free (filename_in);
-      grub_free (filename_out);
-      return grub_error (GRUB_ERR_BAD_DEVICE, N_("memory devices aren't supported"));
+      source.disk = open_device (args[0], "source");
+      if ( ! source.disk )
+        return grub_errno;
+
+      copy.source_size = grub_disk_get_size (source.disk);
     }
-  else if ( (filename_in[0] != '(') || (filename_in[namelen_in - 1] != ')') )
+
+  grub_memset (&pipeline, 0, sizeof (pipeline));
+  grub_memset (&bad, 0, sizeof (bad));
+  checkpoint.file = NULL;
+
+  for ( k = nsources; k < argc; k++ )
     {
-      grub_free (filename_in);
-      grub_free (filename_out);
-      return grub_error (GRUB_ERR_BAD_ARGUMENT, N_("filename of a device expected (source)"));
+      copy.targets[copy.ntargets] = open_device (args[k], "target");
+      if ( ! copy.targets[copy.ntargets] )
+        {
+          err = grub_errno;
+          goto out;
+        }
+      copy.ntargets++;
     }
-  else if ( (filename_out[0] != '(') || (filename_out[namelen_out - 1] != ')') )
+
+  if ( copy.source_size == GRUB_DISK_SIZE_UNKNOWN )
     {
-      grub_free (filename_in);
-      grub_free (filename_out);
-      return grub_error (GRUB_ERR_BAD_ARGUMENT, N_("filename of a device expected (target)"));
+      err = grub_error (GRUB_ERR_BAD_DEVICE, N_("size of the source device is unknown"));
+      goto out;
     }
 
-  grub_disk_t disk_in, disk_out;
+  grub_printf (N_("Source: %s (size, sectors: %llu)\n"), source.array ? array.name : source.disk->name,
+               (unsigned long long)copy.source_size);
+  if ( source.array )
+    grub_printf (N_("Array: %d members, %lu KiB chunks%s%s\n"), array.nmembers, stripe_kib,
+                 level == 5 ? ", " : "", level == 5 ? raid5_layouts[layout] : "");
 
-  filename_in[namelen_in - 1] = 0;
-  disk_in = grub_disk_open (&filename_in[1]);
-  if (! disk_in)
+  if ( ! state[RAIDDUMP_COUNT].set )
     {
-      grub_free (filename_in);
-      grub_free (filename_out);
-      return 0;
+      count = copy.source_size - copy.start;
+
+      /* a sample of a small source is all of it */
+      if ( dump_mode && count > 20480 )
+        count = 20480;
     }
 
-  filename_out[namelen_out- 1] = 0;
-  disk_out = grub_disk_open (&filename_out[1]);
-  if (! disk_out)
+  copy.end = copy.start + count;
+  if ( copy.start > copy.source_size || count > copy.source_size - copy.start )
     {
-      grub_free (filename_in);
-      grub_free (filename_out);
-      grub_disk_close (disk_in);
-      return 0;
+      err = grub_error (GRUB_ERR_OUT_OF_RANGE, N_("the sectors to copy are past the end of the source"));
+      goto out;
     }
 
-  grub_uint64_t size_disk_in, size_disk_out;
-  size_disk_in = grub_disk_get_size (disk_in);
-  if ( size_disk_in == GRUB_DISK_SIZE_UNKNOWN )
+  for ( k = 0; k < copy.ntargets; k++ )
     {
-      grub_free (filename_in);
-      grub_free (filename_out);
-      grub_disk_close (disk_in);
-      grub_disk_close (disk_out);
-      return grub_error (GRUB_ERR_BAD_DEVICE, N_("size of the source device is unknown"));
+      grub_uint64_t size_disk_out = grub_disk_get_size (copy.targets[k]);
+
+      if ( size_disk_out == GRUB_DISK_SIZE_UNKNOWN )
+        {
+          err = grub_error (GRUB_ERR_BAD_DEVICE, N_("size of the target device is unknown"));
+          goto out;
+        }
+
+      grub_printf (N_("Target: %s (size, sectors: %llu)\n"), copy.targets[k]->name,
+                   (unsigned long long)size_disk_out);
+
+      if ( copy.seek > size_disk_out || count > size_disk_out - copy.seek )
+        {
+          err = grub_error (GRUB_ERR_OUT_OF_RANGE, N_("target %s is too small"), copy.targets[k]->name);
+          goto out;
+        }
     }
 
-  size_disk_out = grub_disk_get_size (disk_out);
-  if ( size_disk_out == GRUB_DISK_SIZE_UNKNOWN )
+  start = copy.start;
+  if ( state[RAIDDUMP_CHECKPOINT].set )
     {
-      grub_free (filename_in);
-      grub_free (filename_out);
-      grub_disk_close (disk_in);
-      grub_disk_close (disk_out);
-      return grub_error (GRUB_ERR_BAD_DEVICE, N_("size of the target device is unknown"));
+      err = checkpoint_open (&checkpoint, state[RAIDDUMP_CHECKPOINT].arg);
+      if ( ! err && state[RAIDDUMP_RESUME].set )
+        err = checkpoint_resume (&checkpoint, &copy, &start);
+      else if ( ! err )
+        /* a stale record must not be resumed once this copy has started */
+        err = checkpoint_save (&checkpoint, &copy, copy.start, copy.start, 0);
+
+      if ( err )
+        goto out;
     }
 
-  grub_uint64_t copy_len;
-  copy_len = size_disk_in;
-  if ( dump_mode == 1 )
-    copy_len = 20480;
+  err = pipeline_init (&pipeline, RAIDDUMP_BUFFERS, chunk_len, start, copy.end);
+  if ( err )
+    goto out;
+
+  if ( state[RAIDDUMP_CONTINUE].set )
+    pipeline.bad = &bad;
 
-  grub_printf (N_("Source: %s (size, sectors: %llu)\nTarget: %s (size, sectors: %llu)\n"),
-               &filename_in[1], (unsigned long long)size_disk_in, &filename_out[1], (unsigned long long)size_disk_out);
+  progress_init (&progress, copy.start, start, copy.end);
 
-  grub_disk_addr_t i;
-  grub_uint64_t b_written;
+  if ( hash_mode )
+    {
+      err = hash_device (&pipeline, &source, &progress);
+      goto report;
+    }
+
+  if ( verify )
+    {
+      vbuf = grub_memalign (RAIDDUMP_BUFFER_ALIGN, chunk_len << GRUB_DISK_SECTOR_BITS);
+      if ( ! vbuf )
+        {
+          err = grub_error (GRUB_ERR_OUT_OF_MEMORY, N_("out of memory"));
+          goto out;
+        }
+    }
+
+  grub_uint64_t b_written, b_skipped, mismatched;
 
   b_written = 0;
-  for ( i = 0; i < copy_len; i++ )
+  b_skipped = 0;
+  mismatched = 0;
+  while ( (b = pipeline_next (&pipeline, &source)) != NULL )
     {
-      if ( grub_disk_read (disk_in, i, 0, sizeof(buf), buf) != GRUB_ERR_NONE )
+      grub_uint64_t skipped = 0;
+      grub_uint32_t crc = 0;
+
+      /* every target is written from the one read of the chunk */
+      if ( write_targets (&copy, b, state[RAIDDUMP_SPARSE].set, &skipped) != GRUB_ERR_NONE )
         break;
 
-      if ( grub_disk_write (disk_out, i, 0, sizeof(buf), buf) != GRUB_ERR_NONE )
+      b_written += (b->good << GRUB_DISK_SECTOR_BITS) - skipped;
+      b_skipped += skipped;
+
+      if ( verify || checkpoint.file )
+        crc = grub_getcrc32c (0, b->data, b->good << GRUB_DISK_SECTOR_BITS);
+
+      if ( verify && verify_targets (&copy, b, crc, vbuf, &mismatched) != GRUB_ERR_NONE )
+        break;
+
+      if ( checkpoint.file && b->good
+           && checkpoint_save (&checkpoint, &copy, b->sector, b->sector + b->good, crc) != GRUB_ERR_NONE )
         break;
 
-      b_written += sizeof(buf);
+      progress_update (&progress, b->sector + b->good);
+
+      /* the sectors before the bad one are written and counted by now */
+      if ( b->good != b->count )
+        {
+          grub_error (b->err, N_("can't read sector %llu"),
+                      (unsigned long long)(b->sector + b->good));
+          break;
+        }
+
+      pipeline_release (&pipeline);
     }
 
+  /* a failed write, verify, checkpoint or hard read ends the loop early */
+  err = grub_errno;
+
   grub_printf (N_("Wrote: %llu bytes\n"), (unsigned long long)b_written);
+  if ( state[RAIDDUMP_SPARSE].set )
+    grub_printf (N_("Skipped: %llu bytes of zeros\n"), (unsigned long long)b_skipped);
+
+  if ( verify )
+    {
+      grub_printf (N_("Mismatched: %llu sectors\n"), (unsigned long long)mismatched);
+      if ( mismatched && ! err )
+        err = grub_error (GRUB_ERR_IO, N_("the target doesn't match the source"));
+    }
+
+  progress_done (&progress);
+
+ report:
+  if ( bad.sectors )
+    {
+      badlist_print (&bad);
+      if ( ! err && ! grub_errno )
+        err = grub_error (GRUB_ERR_READ_ERROR, N_("%llu sectors couldn't be read"),
+                          (unsigned long long)bad.sectors);
+    }
 
-  grub_free (filename_in);
-  grub_free (filename_out);
-  grub_disk_close (disk_in);
-  grub_disk_close (disk_out);
+ out:
+  grub_free (bad.ranges);
+  grub_free (vbuf);
+  pipeline_free (&pipeline);
+  checkpoint_close (&checkpoint);
+  if ( source.array )
+    array_close (&array);
+  else
+    grub_disk_close (source.disk);
+  for ( k = 0; k < copy.ntargets; k++ )
+    grub_disk_close (copy.targets[k]);
 
-  return 0;
+  return err;
 }
 
-static grub_command_t cmd;
+static grub_extcmd_t cmd;
 
 GRUB_MOD_INIT (raiddump)
 {
-  cmd = grub_register_command ("raiddump", grub_cmd_raiddump, N_("SOURCE TARGET [sample]"),
-			      N_("Copy the contents of a source drive to a target drive.\nWhen \"sample\" was specified, only the first 20480 sectors are copied.\n"));
+  cmd = grub_register_extcmd ("raiddump", grub_cmd_raiddump, 0, N_("[-b MIB] [-s] [-v] [-e] [-c FILE [-r]] [--skip N] [--seek N] [--count N] SOURCE TARGET... [sample]"
+				 " | -h [-e] [--skip N] [--count N] SOURCE [sample]"
+				 " | --raid LEVEL [--stripe KIB] [--layout LAYOUT] -m MEMBER... [OPTIONS] [TARGET...] [sample]"),
+			      N_("Copy the contents of a source drive to one or more target drives, reading the source once.\nWhen \"sample\" was specified, only the first 20480 sectors are copied.\nWith --hash, only print the checksum of the source drive.\nWith --raid, the source is the array assembled from the members.\n"),
+			      options);
 }
 
 GRUB_MOD_FINI (raiddump)
 {
-  grub_unregister_command (cmd);
+  grub_unregister_extcmd (cmd);
 }
@@ -0,0 +1,209 @@
+/* arena.c - the memory of the nodes and names of a virtual file system.  */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2019  Free Software Foundation, Inc.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <grub/mm.h>
+#include <grub/misc.h>
+#include "vfs.h"
+
+/* The size of the blocks the arena is carved from */
+#define ARENA_BLOCK_SIZE 16384
+
+/* Allocations bigger than this get a block of their own */
+#define ARENA_BIG_SIZE (ARENA_BLOCK_SIZE / 4)
+
+#define ARENA_ALIGN 8
+
+struct grub_vfs_arena_block
+{
+  struct grub_vfs_arena_block *next;
+  grub_size_t size;
+  grub_size_t used;
+};
+
+/* Leave room for the block header, keeping the alignment */
+#define ARENA_HEADER_SIZE ALIGN_UP (sizeof (struct grub_vfs_arena_block), \
+				    ARENA_ALIGN)
+
+/* Free nodes are kept on a list threaded through the nodes themselves */
+struct free_node
+{
+  struct free_node *next;
+};
+
+void *
+grub_vfs_arena_alloc (struct grub_vfs_arena *arena, grub_size_t size)
+{
+  struct grub_vfs_arena_block *block = arena->blocks;
+
+  size = ALIGN_UP (size, ARENA_ALIGN);
+
+  if (size > ARENA_BIG_SIZE)
+    {
+      /* big allocations go behind the current block, which stays in use */
+      struct grub_vfs_arena_block *big;
+
+      big = grub_malloc (ARENA_HEADER_SIZE + size);
+      if (!big)
+	return NULL;
+
+      big->size = big->used = size;
+      arena->size += size;
+      if (block)
+	{
+	  big->next = block->next;
+	  block->next = big;
+	}
+      else
+	{
+	  big->next = NULL;
+	  arena->blocks = big;
+	}
+
+      return (grub_uint8_t *) big + ARENA_HEADER_SIZE;
+    }
+
+  if (!block || block->size - block->used < size)
+    {
+      block = grub_malloc (ARENA_HEADER_SIZE + ARENA_BLOCK_SIZE);
+      if (!block)
+	return NULL;
+
+      block->size = ARENA_BLOCK_SIZE;
+      block->used = 0;
+      arena->size += ARENA_BLOCK_SIZE;
+      block->next = arena->blocks;
+      arena->blocks = block;
+    }
+
+  block->used += size;
+  return (grub_uint8_t *) block + ARENA_HEADER_SIZE + block->used - size;
+}
+
+struct grub_vfs_node *
+grub_vfs_arena_node (struct grub_vfs_arena *arena)
+{
+  struct grub_vfs_node *node;
+
+  if (arena->free_nodes)
+    {
+      struct free_node *free = arena->free_nodes;
+
+      arena->free_nodes = free->next;
+      node = (struct grub_vfs_node *) free;
+    }
+  else
+    {
+      node = grub_vfs_arena_alloc (arena, sizeof (*node));
+      if (!node)
+	return NULL;
+    }
+
+  grub_memset (node, 0, sizeof (*node));
+  return node;
+}
+
+void
+grub_vfs_arena_free_node (struct grub_vfs_arena *arena,
+			  struct grub_vfs_node *node)
+{
+  struct free_node *free = (struct free_node *) node;
+
+  free->next = arena->free_nodes;
+  arena->free_nodes = free;
+}
+
+/* FNV-1a, the names are interned case sensitively */
+static grub_uint32_t
+hash_string (const char *str)
+{
+  grub_uint32_t hash = 2166136261U;
+
+  for (; *str != '\0'; str++)
+    {
+      hash ^= (grub_uint8_t) *str;
+      hash *= 16777619U;
+    }
+
+  return hash;
+}
+
+const char *
+grub_vfs_arena_intern (struct grub_vfs_arena *arena, const char *name)
+{
+  grub_size_t mask, i;
+  grub_size_t len;
+  char *copy;
+
+  /* keep the load factor at most 1/2 */
+  if ((arena->nnames + 1) * 2 > arena->names_size)
+    {
+      grub_size_t size = arena->names_size ? arena->names_size * 2 : 64;
+      const char **names = grub_zalloc (size * sizeof (names[0]));
+
+      if (!names)
+	return NULL;
+
+      for (i = 0; i < arena->names_size; i++)
+	if (arena->names[i])
+	  {
+	    grub_size_t j = hash_string (arena->names[i]) & (size - 1);
+
+	    while (names[j])
+	      j = (j + 1) & (size - 1);
+	    names[j] = arena->names[i];
+	  }
+
+      grub_free (arena->names);
+      arena->names = names;
+      arena->names_size = size;
+    }
+
+  mask = arena->names_size - 1;
+  for (i = hash_string (name) & mask; arena->names[i]; i = (i + 1) & mask)
+    if (grub_strcmp (arena->names[i], name) == 0)
+      return arena->names[i];
+
+  len = grub_strlen (name) + 1;
+  copy = grub_vfs_arena_alloc (arena, len);
+  if (!copy)
+    return NULL;
+
+  grub_memcpy (copy, name, len);
+  arena->names[i] = copy;
+  arena->nnames++;
+
+  return copy;
+}
+
+void
+grub_vfs_arena_release (struct grub_vfs_arena *arena)
+{
+  struct grub_vfs_arena_block *block = arena->blocks;
+
+  while (block)
+    {
+      struct grub_vfs_arena_block *next = block->next;
+
+      grub_free (block);
+      block = next;
+    }
+
+  grub_free (arena->names);
+  grub_memset (arena, 0, sizeof (*arena));
+}
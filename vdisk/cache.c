@@ -0,0 +1,277 @@
+/* cache.c - the read cache of linked files.  */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2019  Free Software Foundation, Inc.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <grub/mm.h>
+#include <grub/misc.h>
+#include <grub/file.h>
+#include "vfs.h"
+
+#define VFS_CACHE_BLOCK_SHIFT GRUB_VFS_CACHE_BLOCK_SHIFT
+#define VFS_CACHE_BLOCK_SIZE (1 << VFS_CACHE_BLOCK_SHIFT)
+
+/* The number of blocks read at once when the reads are sequential */
+#define VFS_READAHEAD_BLOCKS 16
+
+struct cache_block
+{
+  /* The block number in the file */
+  grub_off_t block;
+
+  /* The number of valid bytes, short at the end of file */
+  grub_size_t len;
+
+  grub_uint8_t *data;
+
+  /* LRU list, the head is the most recently used block */
+  struct cache_block *lru_prev;
+  struct cache_block *lru_next;
+
+  /* hash chain */
+  struct cache_block *hash_next;
+};
+
+struct grub_vfs_cache
+{
+  grub_size_t nblocks;
+  struct cache_block *blocks;
+  struct cache_block **hash;
+  struct cache_block *lru;
+
+  /* The block data, and the buffer the read-ahead is done into */
+  grub_uint8_t *data;
+  grub_uint8_t *readahead;
+
+  /* The block following the last miss, to detect sequential reads */
+  grub_off_t next_block;
+};
+
+struct grub_vfs_cache *
+grub_vfs_cache_new (grub_size_t nblocks)
+{
+  struct grub_vfs_cache *cache;
+  grub_size_t i;
+
+  if (nblocks == 0)
+    return NULL;
+
+  cache = grub_zalloc (sizeof (*cache));
+  if (!cache)
+    goto fail;
+
+  cache->nblocks = nblocks;
+  cache->blocks = grub_zalloc (nblocks * sizeof (cache->blocks[0]));
+  cache->hash = grub_zalloc (nblocks * sizeof (cache->hash[0]));
+  cache->data = grub_malloc (nblocks << VFS_CACHE_BLOCK_SHIFT);
+  cache->readahead = grub_malloc (VFS_READAHEAD_BLOCKS
+				  << VFS_CACHE_BLOCK_SHIFT);
+  if (!cache->blocks || !cache->hash || !cache->data || !cache->readahead)
+    goto fail;
+
+  /* all the blocks start unused, on a circular LRU list */
+  for (i = 0; i < nblocks; i++)
+    {
+      struct cache_block *b = &cache->blocks[i];
+
+      b->block = (grub_off_t) -1;
+      b->data = cache->data + (i << VFS_CACHE_BLOCK_SHIFT);
+      b->lru_next = &cache->blocks[(i + 1) % nblocks];
+      b->lru_prev = &cache->blocks[(i + nblocks - 1) % nblocks];
+    }
+  cache->lru = &cache->blocks[0];
+  cache->next_block = (grub_off_t) -1;
+
+  return cache;
+
+fail:
+  grub_vfs_cache_free (cache);
+  grub_error (GRUB_ERR_OUT_OF_MEMORY, N_ ("out of memory"));
+  return NULL;
+}
+
+void
+grub_vfs_cache_free (struct grub_vfs_cache *cache)
+{
+  if (!cache)
+    return;
+
+  grub_free (cache->blocks);
+  grub_free (cache->hash);
+  grub_free (cache->data);
+  grub_free (cache->readahead);
+  grub_free (cache);
+}
+
+/* Make B the most recently used block */
+static void
+touch_block (struct grub_vfs_cache *cache, struct cache_block *b)
+{
+  if (cache->lru == b)
+    return;
+
+  b->lru_prev->lru_next = b->lru_next;
+  b->lru_next->lru_prev = b->lru_prev;
+
+  b->lru_next = cache->lru;
+  b->lru_prev = cache->lru->lru_prev;
+  cache->lru->lru_prev->lru_next = b;
+  cache->lru->lru_prev = b;
+  cache->lru = b;
+}
+
+static struct cache_block *
+find_block (struct grub_vfs_cache *cache, grub_off_t block)
+{
+  struct cache_block *b;
+
+  for (b = cache->hash[block % cache->nblocks]; b; b = b->hash_next)
+    if (b->block == block)
+      return b;
+
+  return NULL;
+}
+
+/* Take the least recently used block out of the hash, for reuse */
+static struct cache_block *
+evict_block (struct grub_vfs_cache *cache)
+{
+  struct cache_block *b = cache->lru->lru_prev;
+  struct cache_block **p;
+
+  if (b->block != (grub_off_t) -1)
+    for (p = &cache->hash[b->block % cache->nblocks]; *p;
+	 p = &(*p)->hash_next)
+      if (*p == b)
+	{
+	  *p = b->hash_next;
+	  break;
+	}
+
+  b->block = (grub_off_t) -1;
+  b->hash_next = NULL;
+  return b;
+}
+
+/* Read BLOCK from FILE into the cache, with read-ahead if the reads look
+   sequential */
+static struct cache_block *
+fill_block (struct grub_vfs_cache *cache, grub_file_t file, grub_off_t block)
+{
+  grub_size_t count = 1;
+  grub_size_t i;
+  grub_ssize_t got;
+
+  if (block == cache->next_block)
+    {
+      count = VFS_READAHEAD_BLOCKS;
+      /* never evict the block we are about to return */
+      if (count > cache->nblocks)
+	count = cache->nblocks;
+    }
+
+  if (grub_file_tell (file) != block << VFS_CACHE_BLOCK_SHIFT)
+    grub_file_seek (file, block << VFS_CACHE_BLOCK_SHIFT);
+  got = grub_file_read (file, cache->readahead,
+			count << VFS_CACHE_BLOCK_SHIFT);
+  if (got < 0)
+    return NULL;
+
+  cache->next_block = block + count;
+
+  /* insert the blocks backwards, so BLOCK ends up most recently used */
+  for (i = count; i-- > 0;)
+    {
+      grub_size_t off = i << VFS_CACHE_BLOCK_SHIFT;
+      struct cache_block *b;
+
+      if (off >= (grub_size_t) got && i > 0)
+	continue;
+
+      b = find_block (cache, block + i);
+      if (!b)
+	{
+	  b = evict_block (cache);
+	  b->block = block + i;
+	  b->hash_next = cache->hash[b->block % cache->nblocks];
+	  cache->hash[b->block % cache->nblocks] = b;
+	}
+
+      b->len = off < (grub_size_t) got ? (grub_size_t) got - off : 0;
+      if (b->len > VFS_CACHE_BLOCK_SIZE)
+	b->len = VFS_CACHE_BLOCK_SIZE;
+      grub_memcpy (b->data, cache->readahead + off, b->len);
+      touch_block (cache, b);
+    }
+
+  return cache->lru;
+}
+
+grub_ssize_t
+grub_vfs_cache_read (struct grub_vfs_cache *cache, grub_file_t file,
+		     grub_off_t pos, char *buf, grub_size_t len,
+		     struct grub_vfs_stats *stats)
+{
+  grub_ssize_t total = 0;
+
+  /* big reads gain nothing from a copy through the cache */
+  if (len >= (VFS_READAHEAD_BLOCKS << VFS_CACHE_BLOCK_SHIFT))
+    {
+      if (grub_file_tell (file) != pos)
+	grub_file_seek (file, pos);
+      return grub_file_read (file, buf, len);
+    }
+
+  while (len > 0)
+    {
+      grub_off_t block = pos >> VFS_CACHE_BLOCK_SHIFT;
+      grub_size_t off = pos & (VFS_CACHE_BLOCK_SIZE - 1);
+      grub_size_t n = VFS_CACHE_BLOCK_SIZE - off;
+      struct cache_block *b;
+
+      b = find_block (cache, block);
+      if (b)
+	{
+	  touch_block (cache, b);
+	  stats->cache_hits++;
+	}
+      else
+	{
+	  stats->cache_misses++;
+	  b = fill_block (cache, file, block);
+	  if (!b)
+	    return -1;
+	}
+
+      /* end of file */
+      if (off >= b->len)
+	break;
+
+      if (n > b->len - off)
+	n = b->len - off;
+      if (n > len)
+	n = len;
+
+      grub_memcpy (buf, b->data + off, n);
+      pos += n;
+      buf += n;
+      len -= n;
+      total += n;
+    }
+
+  return total;
+}
@@ -0,0 +1,312 @@
+/* compress.c - compression of the chunks of memory files.  */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2019  Free Software Foundation, Inc.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <grub/mm.h>
+#include <grub/misc.h>
+#include "vfs.h"
+
+/*
+ * Chunks are compressed in the LZ4 block format. GRUB only carries
+ * decompressors, and a chunk is small enough for a plain greedy
+ * compressor to do well.
+ */
+#define LZ4_MINMATCH 4
+#define LZ4_LASTLITERALS 5
+#define LZ4_MFLIMIT 12
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 12
+#define LZ4_NO_POS 0xffffffff
+
+/* The number of decompressed chunks kept around */
+#define VFS_ZCACHE_ENTRIES 8
+
+static grub_uint32_t lz4_table[1 << LZ4_HASH_BITS];
+
+struct zcache_entry
+{
+  /* The compressed data the entry was decompressed from */
+  const grub_uint8_t *key;
+
+  grub_uint8_t *data;
+  grub_uint32_t stamp;
+};
+
+static struct zcache_entry zcache[VFS_ZCACHE_ENTRIES];
+static grub_uint32_t zcache_clock;
+static grub_uint64_t zcache_hits;
+static grub_uint64_t zcache_misses;
+
+static grub_uint32_t
+read32 (const grub_uint8_t *p)
+{
+  grub_uint32_t val;
+
+  grub_memcpy (&val, p, sizeof (val));
+  return val;
+}
+
+static grub_uint32_t
+hash4 (grub_uint32_t val)
+{
+  return (val * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/* Write a sequence of literals from ANCHOR up to IP, then the match of
+   MLEN bytes at OFFSET if MLEN is not 0 */
+static grub_uint8_t *
+put_sequence (grub_uint8_t *op, grub_uint8_t *oend,
+	      const grub_uint8_t *anchor, const grub_uint8_t *ip,
+	      grub_size_t offset, grub_size_t mlen)
+{
+  grub_size_t lit = ip - anchor;
+  grub_uint8_t *token;
+
+  /* token, literal length, literals, offset and match length */
+  if (lit + lit / 255 + mlen / 255 + 5 > (grub_size_t) (oend - op))
+    return NULL;
+
+  token = op++;
+  if (lit >= 15)
+    {
+      grub_size_t rest = lit - 15;
+
+      *token = 15 << 4;
+      for (; rest >= 255; rest -= 255)
+	*op++ = 255;
+      *op++ = rest;
+    }
+  else
+    *token = lit << 4;
+
+  grub_memcpy (op, anchor, lit);
+  op += lit;
+
+  if (mlen == 0)
+    return op;
+
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+
+  mlen -= LZ4_MINMATCH;
+  if (mlen >= 15)
+    {
+      *token |= 15;
+      for (mlen -= 15; mlen >= 255; mlen -= 255)
+	*op++ = 255;
+      *op++ = mlen;
+    }
+  else
+    *token |= mlen;
+
+  return op;
+}
+
+grub_size_t
+grub_vfs_compress (const grub_uint8_t *src, grub_size_t len,
+		   grub_uint8_t *dst, grub_size_t cap)
+{
+  const grub_uint8_t *ip = src;
+  const grub_uint8_t *anchor = src;
+  const grub_uint8_t *iend = src + len;
+  grub_uint8_t *op = dst;
+  grub_uint8_t *oend = dst + cap;
+
+  if (len > LZ4_MFLIMIT)
+    {
+      const grub_uint8_t *mflimit = iend - LZ4_MFLIMIT;
+      const grub_uint8_t *matchlimit = iend - LZ4_LASTLITERALS;
+
+      grub_memset (lz4_table, 0xff, sizeof (lz4_table));
+
+      while (ip < mflimit)
+	{
+	  grub_uint32_t h = hash4 (read32 (ip));
+	  grub_uint32_t ref = lz4_table[h];
+	  const grub_uint8_t *match;
+	  grub_size_t mlen;
+
+	  lz4_table[h] = ip - src;
+
+	  if (ref == LZ4_NO_POS || (grub_size_t) (ip - src) - ref > LZ4_MAX_OFFSET
+	      || read32 (src + ref) != read32 (ip))
+	    {
+	      ip++;
+	      continue;
+	    }
+
+	  match = src + ref;
+	  for (mlen = LZ4_MINMATCH;
+	       ip + mlen < matchlimit && match[mlen] == ip[mlen]; mlen++)
+	    ;
+
+	  op = put_sequence (op, oend, anchor, ip, ip - match, mlen);
+	  if (!op)
+	    return 0;
+
+	  ip += mlen;
+	  anchor = ip;
+	}
+    }
+
+  op = put_sequence (op, oend, anchor, iend, 0, 0);
+  if (!op)
+    return 0;
+
+  return op - dst;
+}
+
+grub_err_t
+grub_vfs_decompress (const grub_uint8_t *src, grub_size_t len,
+		     grub_uint8_t *dst, grub_size_t size)
+{
+  const grub_uint8_t *ip = src;
+  const grub_uint8_t *iend = src + len;
+  grub_uint8_t *op = dst;
+  grub_uint8_t *oend = dst + size;
+
+  while (ip < iend)
+    {
+      grub_uint8_t token = *ip++;
+      grub_size_t lit = token >> 4;
+      grub_size_t mlen = token & 15;
+      grub_size_t offset;
+      grub_uint8_t b;
+
+      if (lit == 15)
+	do
+	  {
+	    if (ip >= iend)
+	      goto corrupted;
+	    b = *ip++;
+	    lit += b;
+	  }
+	while (b == 255);
+
+      if (lit > (grub_size_t) (iend - ip) || lit > (grub_size_t) (oend - op))
+	goto corrupted;
+
+      grub_memcpy (op, ip, lit);
+      ip += lit;
+      op += lit;
+
+      /* the last sequence has no match */
+      if (ip == iend)
+	break;
+
+      if (iend - ip < 2)
+	goto corrupted;
+
+      offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+      if (offset == 0 || offset > (grub_size_t) (op - dst))
+	goto corrupted;
+
+      if (mlen == 15)
+	do
+	  {
+	    if (ip >= iend)
+	      goto corrupted;
+	    b = *ip++;
+	    mlen += b;
+	  }
+	while (b == 255);
+
+      mlen += LZ4_MINMATCH;
+      if (mlen > (grub_size_t) (oend - op))
+	goto corrupted;
+
+      /* the match may overlap the output */
+      for (; mlen > 0; mlen--, op++)
+	*op = op[-offset];
+    }
+
+  if (op == oend)
+    return GRUB_ERR_NONE;
+
+corrupted:
+  return grub_error (GRUB_ERR_BAD_COMPRESSED_DATA,
+		     N_ ("compressed chunk is corrupted"));
+}
+
+const grub_uint8_t *
+grub_vfs_zcache_get (const grub_uint8_t *cdata, grub_size_t csize)
+{
+  struct zcache_entry *victim = &zcache[0];
+  unsigned int i;
+
+  for (i = 0; i < VFS_ZCACHE_ENTRIES; i++)
+    {
+      if (zcache[i].key == cdata)
+	{
+	  zcache[i].stamp = ++zcache_clock;
+	  zcache_hits++;
+	  return zcache[i].data;
+	}
+
+      if (zcache[i].stamp < victim->stamp)
+	victim = &zcache[i];
+    }
+
+  if (!victim->data)
+    {
+      victim->data = grub_malloc (GRUB_VFS_CHUNK_SIZE);
+      if (!victim->data)
+	return NULL;
+    }
+
+  zcache_misses++;
+  victim->key = NULL;
+  if (grub_vfs_decompress (cdata, csize, victim->data, GRUB_VFS_CHUNK_SIZE))
+    return NULL;
+
+  victim->key = cdata;
+  victim->stamp = ++zcache_clock;
+  return victim->data;
+}
+
+void
+grub_vfs_zcache_forget (const grub_uint8_t *cdata)
+{
+  unsigned int i;
+
+  for (i = 0; i < VFS_ZCACHE_ENTRIES; i++)
+    if (zcache[i].key == cdata)
+      {
+	zcache[i].key = NULL;
+	zcache[i].stamp = 0;
+      }
+}
+
+void
+grub_vfs_zcache_release (void)
+{
+  unsigned int i;
+
+  for (i = 0; i < VFS_ZCACHE_ENTRIES; i++)
+    grub_free (zcache[i].data);
+
+  grub_memset (zcache, 0, sizeof (zcache));
+}
+
+void
+grub_vfs_zcache_stats (grub_uint64_t *hits, grub_uint64_t *misses)
+{
+  *hits = zcache_hits;
+  *misses = zcache_misses;
+}
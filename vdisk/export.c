@@ -0,0 +1,379 @@
+/* export.c - read a virtual file system as a newc cpio archive.  */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2019  Free Software Foundation, Inc.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <grub/mm.h>
+#include <grub/misc.h>
+#include <grub/file.h>
+#include "vfs.h"
+
+#define CPIO_HEADER_SIZE 110
+#define CPIO_ALIGN 4
+/* The file size field has 8 hex digits */
+#define CPIO_SIZE_MAX 0xffffffffULL
+#define CPIO_TRAILER "TRAILER!!!"
+
+#define CPIO_MODE_DIR 0040755
+#define CPIO_MODE_REG 0100644
+
+/*
+ * The archive is never stored anywhere. Opening it only lays out where
+ * every entry goes, the headers and the file data are produced when the
+ * corresponding range of the archive is read.
+ */
+struct cpio_entry
+{
+  /* The node, NULL for the trailer */
+  struct grub_vfs_node *node;
+
+  /* The path of the node in the archive */
+  char *name;
+
+  /* The offset of the header in the archive */
+  grub_off_t offset;
+
+  /* The size of the header and the name, padded */
+  grub_size_t header_size;
+
+  /* The size of the data, not padded */
+  grub_size_t size;
+};
+
+struct grub_vfs_cpio
+{
+  struct cpio_entry *entries;
+  grub_size_t nentries;
+  grub_size_t entries_size;
+
+  /* The size of the whole archive */
+  grub_off_t size;
+
+  /* The entry being read and its header */
+  grub_size_t current;
+  char *header;
+};
+
+static grub_err_t
+add_entry (struct grub_vfs_cpio *cpio, struct grub_vfs_node *node,
+	   char *name)
+{
+  struct cpio_entry *entry;
+
+  if (cpio->nentries == cpio->entries_size)
+    {
+      grub_size_t new_size = cpio->entries_size ? cpio->entries_size * 2 : 64;
+      struct cpio_entry *new_entries;
+
+      new_entries = grub_realloc (cpio->entries,
+				  new_size * sizeof (cpio->entries[0]));
+      if (!new_entries)
+	return grub_errno;
+
+      cpio->entries = new_entries;
+      cpio->entries_size = new_size;
+    }
+
+  entry = &cpio->entries[cpio->nentries++];
+  entry->node = node;
+  entry->name = name;
+  entry->offset = cpio->size;
+  entry->header_size = ALIGN_UP (CPIO_HEADER_SIZE + grub_strlen (name) + 1,
+				 CPIO_ALIGN);
+  entry->size = 0;
+
+  if (node && node->type != GRUB_VFS_NODE_TYPE_DIRECTORY)
+    {
+      /* a linked file is opened only once its data is read */
+      if (grub_vfs_update_len (node))
+	{
+	  /* the caller still owns NAME */
+	  cpio->nentries--;
+	  return grub_errno;
+	}
+
+      if (node->len > CPIO_SIZE_MAX)
+	{
+	  cpio->nentries--;
+	  return grub_error (GRUB_ERR_OUT_OF_RANGE,
+			     N_ ("file too large for newc cpio"));
+	}
+
+      entry->size = node->len;
+    }
+
+  cpio->size += entry->header_size + ALIGN_UP (entry->size, CPIO_ALIGN);
+  return GRUB_ERR_NONE;
+}
+
+struct tree_data
+{
+  struct grub_vfs_cpio *cpio;
+
+  /* The path of the directory in the archive, NULL for the root */
+  const char *prefix;
+
+  grub_err_t err;
+};
+
+static grub_err_t add_tree (struct grub_vfs_cpio *cpio,
+			    struct grub_vfs_node *dir, const char *prefix);
+
+static int
+add_tree_hook (struct grub_vfs_node *node, void *hook_data)
+{
+  struct tree_data *data = hook_data;
+  char *name;
+
+  /* the iteration goes on after a failure, skip the rest */
+  if (data->err)
+    return 1;
+
+  if (data->prefix)
+    name = grub_xasprintf ("%s/%s", data->prefix, node->name);
+  else
+    name = grub_strdup (node->name);
+
+  if (!name)
+    {
+      data->err = grub_errno;
+      return 1;
+    }
+
+  if (add_entry (data->cpio, node, name))
+    {
+      grub_free (name);
+      data->err = grub_errno;
+      return 1;
+    }
+
+  /* directories go before their contents */
+  if (node->type == GRUB_VFS_NODE_TYPE_DIRECTORY
+      && add_tree (data->cpio, node, name))
+    {
+      data->err = grub_errno;
+      return 1;
+    }
+
+  return 0;
+}
+
+/* Add the children of DIR, PREFIX is the path of DIR in the archive. The
+   entries of an overlay directory are merged in first */
+static grub_err_t
+add_tree (struct grub_vfs_cpio *cpio, struct grub_vfs_node *dir,
+	  const char *prefix)
+{
+  struct tree_data data =
+  {
+    .cpio = cpio,
+    .prefix = prefix,
+    .err = GRUB_ERR_NONE
+  };
+
+  if (grub_vfs_dir (dir, add_tree_hook, &data))
+    return grub_errno;
+
+  return data.err;
+}
+
+struct grub_vfs_cpio *
+grub_vfs_cpio_open (struct grub_vfs *vfs)
+{
+  struct grub_vfs_cpio *cpio = grub_zalloc (sizeof (*cpio));
+  char *trailer;
+
+  if (!cpio)
+    return NULL;
+
+  cpio->current = (grub_size_t) -1;
+
+  if (add_tree (cpio, vfs->root, NULL))
+    goto fail;
+
+  trailer = grub_strdup (CPIO_TRAILER);
+  if (!trailer || add_entry (cpio, NULL, trailer))
+    {
+      grub_free (trailer);
+      goto fail;
+    }
+
+  return cpio;
+
+fail:
+  grub_vfs_cpio_close (cpio);
+  return NULL;
+}
+
+grub_off_t
+grub_vfs_cpio_size (struct grub_vfs_cpio *cpio)
+{
+  return cpio->size;
+}
+
+/* Make entry IDX the current one */
+static grub_err_t
+select_entry (struct grub_vfs_cpio *cpio, grub_size_t idx)
+{
+  struct cpio_entry *entry = &cpio->entries[idx];
+  grub_size_t namesize = grub_strlen (entry->name) + 1;
+  grub_uint32_t mode = 0;
+
+  if (cpio->current == idx)
+    return GRUB_ERR_NONE;
+
+  cpio->current = (grub_size_t) -1;
+
+  grub_free (cpio->header);
+  cpio->header = grub_zalloc (entry->header_size + 1);
+  if (!cpio->header)
+    return grub_errno;
+
+  if (entry->node)
+    mode = entry->node->type == GRUB_VFS_NODE_TYPE_DIRECTORY
+      ? CPIO_MODE_DIR : CPIO_MODE_REG;
+
+  /* ino, mode, uid, gid, nlink, mtime, filesize, dev and rdev major and
+     minor, namesize and check */
+  grub_snprintf (cpio->header, CPIO_HEADER_SIZE + 1,
+		 "070701%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x",
+		 (unsigned int) idx + 1, mode, 0, 0,
+		 mode == CPIO_MODE_DIR ? 2 : 1, 0,
+		 (unsigned int) entry->size, 0, 0, 0, 0,
+		 (unsigned int) namesize, 0);
+  grub_memcpy (cpio->header + CPIO_HEADER_SIZE, entry->name, namesize);
+
+  cpio->current = idx;
+  return GRUB_ERR_NONE;
+}
+
+/* Find the entry covering POS */
+static grub_size_t
+find_entry (struct grub_vfs_cpio *cpio, grub_off_t pos)
+{
+  grub_size_t lo = 0;
+  grub_size_t hi = cpio->nentries;
+
+  /* the reads are mostly sequential */
+  if (cpio->current < cpio->nentries)
+    {
+      struct cpio_entry *entry = &cpio->entries[cpio->current];
+
+      if (pos >= entry->offset
+	  && pos < entry->offset + entry->header_size
+	  + ALIGN_UP (entry->size, CPIO_ALIGN))
+	return cpio->current;
+    }
+
+  while (hi - lo > 1)
+    {
+      grub_size_t mid = lo + (hi - lo) / 2;
+
+      if (cpio->entries[mid].offset <= pos)
+	lo = mid;
+      else
+	hi = mid;
+    }
+
+  return lo;
+}
+
+grub_ssize_t
+grub_vfs_cpio_read (struct grub_vfs_cpio *cpio, grub_off_t pos, char *buf,
+		    grub_size_t len)
+{
+  grub_ssize_t total = 0;
+
+  if (pos >= cpio->size)
+    return 0;
+
+  if (len > cpio->size - pos)
+    len = cpio->size - pos;
+
+  while (len > 0)
+    {
+      grub_size_t idx = find_entry (cpio, pos);
+      struct cpio_entry *entry = &cpio->entries[idx];
+      grub_off_t off = pos - entry->offset;
+      grub_size_t n;
+
+      if (select_entry (cpio, idx))
+	return -1;
+
+      if (off < entry->header_size)
+	{
+	  /* the header, the name and their padding */
+	  n = entry->header_size - off;
+	  if (n > len)
+	    n = len;
+
+	  grub_memcpy (buf, cpio->header + off, n);
+	}
+      else if (off - entry->header_size < entry->size)
+	{
+	  /* the data, straight from the node */
+	  grub_ssize_t got;
+
+	  off -= entry->header_size;
+	  n = entry->size - off;
+	  if (n > len)
+	    n = len;
+
+	  got = grub_vfs_pread (entry->node, off, buf, n);
+	  if (got < 0)
+	    return -1;
+	  if ((grub_size_t) got != n)
+	    {
+	      grub_error (GRUB_ERR_FILE_READ_ERROR,
+			  N_ ("`%s' changed while it was read"), entry->name);
+	      return -1;
+	    }
+	}
+      else
+	{
+	  /* the padding of the data */
+	  n = entry->header_size + ALIGN_UP (entry->size, CPIO_ALIGN) - off;
+	  if (n > len)
+	    n = len;
+
+	  grub_memset (buf, 0, n);
+	}
+
+      pos += n;
+      buf += n;
+      len -= n;
+      total += n;
+    }
+
+  return total;
+}
+
+void
+grub_vfs_cpio_close (struct grub_vfs_cpio *cpio)
+{
+  grub_size_t i;
+
+  if (!cpio)
+    return;
+
+  for (i = 0; i < cpio->nentries; i++)
+    grub_free (cpio->entries[i].name);
+
+  grub_free (cpio->entries);
+  grub_free (cpio->header);
+  grub_free (cpio);
+}
@@ -0,0 +1,510 @@
+/* import.c - build a virtual file system from a cpio or tar archive.  */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2019  Free Software Foundation, Inc.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <grub/mm.h>
+#include <grub/misc.h>
+#include <grub/file.h>
+#include "vfs.h"
+
+/* newc cpio */
+#define CPIO_HEADER_SIZE 110
+#define CPIO_ALIGN 4
+#define CPIO_TRAILER "TRAILER!!!"
+
+#define CPIO_MODE_TYPE 0170000
+#define CPIO_MODE_DIR  0040000
+#define CPIO_MODE_REG  0100000
+
+/* ustar */
+#define TAR_BLOCK_SIZE 512
+#define TAR_NAME_OFF 0
+#define TAR_NAME_LEN 100
+#define TAR_SIZE_OFF 124
+#define TAR_SIZE_LEN 12
+#define TAR_CHKSUM_OFF 148
+#define TAR_CHKSUM_LEN 8
+#define TAR_TYPE_OFF 156
+#define TAR_MAGIC_OFF 257
+#define TAR_PREFIX_OFF 345
+#define TAR_PREFIX_LEN 155
+
+enum
+{
+  IMPORT_ENTRY_FILE,
+  IMPORT_ENTRY_DIR,
+  IMPORT_ENTRY_OTHER
+};
+
+struct import_ctx
+{
+  /* The directory the archive is imported into */
+  struct grub_vfs_node *root;
+
+  grub_file_t archive;
+
+  /* The directory of the last entry, archives are mostly sorted so
+     this saves the walk from the root for most entries */
+  char *last_dir;
+  grub_size_t last_dir_len;
+  grub_size_t last_dir_size;
+  struct grub_vfs_node *last_node;
+};
+
+/* Find the child NAME of NODE, or NULL without raising an error */
+static struct grub_vfs_node *
+find_node (struct grub_vfs_node *node, const char *name)
+{
+  struct grub_vfs_node *found;
+
+  if (grub_vfs_lookup (node, name, &found))
+    {
+      grub_errno = GRUB_ERR_NONE;
+      return NULL;
+    }
+
+  return found;
+}
+
+/* Get the directory PATH of LEN bytes under the import root, making the
+   missing directories on the way */
+static struct grub_vfs_node *
+get_dir (struct import_ctx *ctx, const char *path, grub_size_t len)
+{
+  struct grub_vfs_node *node = ctx->root;
+  const char *p = path;
+  const char *end = path + len;
+
+  if (ctx->last_node && len == ctx->last_dir_len
+      && grub_memcmp (path, ctx->last_dir, len) == 0)
+    return ctx->last_node;
+
+  while (p < end)
+    {
+      struct grub_vfs_node *child;
+      const char *next;
+      char *name;
+
+      while (p < end && *p == '/')
+	p++;
+
+      if (p == end)
+	break;
+
+      for (next = p; next < end && *next != '/'; next++)
+	;
+
+      name = grub_strndup (p, next - p);
+      if (!name)
+	return NULL;
+
+      if (grub_strcmp (name, "..") == 0)
+	{
+	  grub_error (GRUB_ERR_BAD_FILENAME, N_ ("invalid file path `%s'"),
+		      name);
+	  grub_free (name);
+	  return NULL;
+	}
+
+      if (grub_strcmp (name, ".") != 0)
+	{
+	  child = find_node (node, name);
+	  if (!child)
+	    {
+	      if (grub_vfs_mkdir (node, name)
+		  || grub_vfs_lookup (node, name, &child))
+		{
+		  grub_free (name);
+		  return NULL;
+		}
+	    }
+	  else if (child->type != GRUB_VFS_NODE_TYPE_DIRECTORY)
+	    {
+	      grub_error (GRUB_ERR_BAD_FILE_TYPE,
+			  N_ ("`%s' is not a directory"), name);
+	      grub_free (name);
+	      return NULL;
+	    }
+
+	  node = child;
+	}
+
+      grub_free (name);
+      p = next;
+    }
+
+  if (len + 1 > ctx->last_dir_size)
+    {
+      char *buf = grub_realloc (ctx->last_dir, len + 1);
+      if (!buf)
+	return NULL;
+
+      ctx->last_dir = buf;
+      ctx->last_dir_size = len + 1;
+    }
+
+  grub_memcpy (ctx->last_dir, path, len);
+  ctx->last_dir_len = len;
+  ctx->last_node = node;
+
+  return node;
+}
+
+/* Add the entry PATH, the data of a file follows at the current position
+   of the archive */
+static grub_err_t
+add_entry (struct import_ctx *ctx, const char *path, int type,
+	   grub_size_t size)
+{
+  struct grub_vfs_node *dir, *node;
+  const char *base;
+  const char *end;
+
+  if (type == IMPORT_ENTRY_OTHER)
+    {
+      grub_dprintf ("vfs", "skipping special file `%s'\n", path);
+      return GRUB_ERR_NONE;
+    }
+
+  /* strip the trailing slashes of directories */
+  end = path + grub_strlen (path);
+  while (end > path && end[-1] == '/')
+    end--;
+
+  for (base = end; base > path && base[-1] != '/'; base--)
+    ;
+
+  if (base == end || (end - base == 1 && base[0] == '.'))
+    /* the root of the archive */
+    return GRUB_ERR_NONE;
+
+  dir = get_dir (ctx, path, base - path);
+  if (!dir)
+    return grub_errno;
+
+  char *name = grub_strndup (base, end - base);
+  if (!name)
+    return grub_errno;
+
+  node = find_node (dir, name);
+
+  if (type == IMPORT_ENTRY_DIR)
+    {
+      if (!node)
+	grub_vfs_mkdir (dir, name);
+      else if (node->type != GRUB_VFS_NODE_TYPE_DIRECTORY)
+	grub_error (GRUB_ERR_BAD_FILE_TYPE,
+		    N_ ("`%s' is not a directory"), path);
+
+      grub_free (name);
+      return grub_errno;
+    }
+
+  /* files of the archive replace the existing ones */
+  if (node)
+    {
+      if (node->type == GRUB_VFS_NODE_TYPE_DIRECTORY)
+	{
+	  grub_free (name);
+	  return grub_error (GRUB_ERR_BAD_FILE_TYPE,
+			     N_ ("`%s' is a directory"), path);
+	}
+
+      if (grub_vfs_rm (node))
+	{
+	  grub_free (name);
+	  return grub_errno;
+	}
+    }
+
+  if (grub_vfs_mkfile (dir, name, NULL)
+      || grub_vfs_lookup (dir, name, &node))
+    {
+      grub_free (name);
+      return grub_errno;
+    }
+
+  grub_free (name);
+  return grub_vfs_load (node, ctx->archive, size);
+}
+
+/* Read exactly LEN bytes at POS of the archive */
+static grub_err_t
+read_at (grub_file_t archive, grub_off_t pos, void *buf, grub_size_t len)
+{
+  grub_file_seek (archive, pos);
+  if (grub_file_read (archive, buf, len) != (grub_ssize_t) len)
+    {
+      if (!grub_errno)
+	grub_error (GRUB_ERR_BAD_FILE_TYPE, N_ ("premature end of archive"));
+      return grub_errno;
+    }
+
+  return GRUB_ERR_NONE;
+}
+
+/* Parse the fixed width number of LEN digits in BASE at STR */
+static int
+parse_number (const char *str, grub_size_t len, unsigned int base,
+	      grub_uint64_t *num)
+{
+  grub_uint64_t val = 0;
+  int digits = 0;
+  grub_size_t i;
+
+  for (i = 0; i < len; i++)
+    {
+      unsigned int digit;
+      char c = str[i];
+
+      /* tar pads numbers with spaces or NULs */
+      if (base == 8 && (c == ' ' || c == '\0'))
+	{
+	  if (digits)
+	    break;
+	  continue;
+	}
+
+      if (c >= '0' && c <= '9')
+	digit = c - '0';
+      else if (c >= 'a' && c <= 'f')
+	digit = c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F')
+	digit = c - 'A' + 10;
+      else
+	return 0;
+
+      if (digit >= base)
+	return 0;
+
+      val = val * base + digit;
+      digits++;
+    }
+
+  *num = val;
+  return 1;
+}
+
+static grub_err_t
+import_cpio (struct import_ctx *ctx)
+{
+  char hdr[CPIO_HEADER_SIZE];
+  grub_off_t pos = 0;
+
+  for (;;)
+    {
+      grub_uint64_t mode, size, namesize;
+      int type;
+      char *name;
+
+      if (read_at (ctx->archive, pos, hdr, sizeof (hdr)))
+	return grub_errno;
+
+      if (grub_memcmp (hdr, "070701", 6) != 0
+	  && grub_memcmp (hdr, "070702", 6) != 0)
+	return grub_error (GRUB_ERR_BAD_FILE_TYPE,
+			   N_ ("invalid cpio header"));
+
+      if (!parse_number (hdr + 14, 8, 16, &mode)
+	  || !parse_number (hdr + 54, 8, 16, &size)
+	  || !parse_number (hdr + 94, 8, 16, &namesize)
+	  || namesize == 0)
+	return grub_error (GRUB_ERR_BAD_FILE_TYPE,
+			   N_ ("invalid cpio header"));
+
+      name = grub_malloc (namesize + 1);
+      if (!name)
+	return grub_errno;
+
+      if (read_at (ctx->archive, pos + CPIO_HEADER_SIZE, name, namesize))
+	{
+	  grub_free (name);
+	  return grub_errno;
+	}
+      name[namesize] = '\0';
+
+      if (grub_strcmp (name, CPIO_TRAILER) == 0)
+	{
+	  grub_free (name);
+	  return GRUB_ERR_NONE;
+	}
+
+      pos = ALIGN_UP (pos + CPIO_HEADER_SIZE + namesize, CPIO_ALIGN);
+
+      if ((mode & CPIO_MODE_TYPE) == CPIO_MODE_REG)
+	type = IMPORT_ENTRY_FILE;
+      else if ((mode & CPIO_MODE_TYPE) == CPIO_MODE_DIR)
+	type = IMPORT_ENTRY_DIR;
+      else
+	type = IMPORT_ENTRY_OTHER;
+
+      grub_file_seek (ctx->archive, pos);
+      add_entry (ctx, name, type, size);
+      grub_free (name);
+      if (grub_errno)
+	return grub_errno;
+
+      pos = ALIGN_UP (pos + size, CPIO_ALIGN);
+    }
+}
+
+static int
+tar_checksum_ok (const grub_uint8_t *hdr)
+{
+  grub_uint64_t expected;
+  grub_uint32_t sum = 0;
+  unsigned int i;
+
+  if (!parse_number ((const char *) hdr + TAR_CHKSUM_OFF, TAR_CHKSUM_LEN, 8,
+		     &expected))
+    return 0;
+
+  /* the checksum field itself counts as spaces */
+  for (i = 0; i < TAR_BLOCK_SIZE; i++)
+    if (i >= TAR_CHKSUM_OFF && i < TAR_CHKSUM_OFF + TAR_CHKSUM_LEN)
+      sum += ' ';
+    else
+      sum += hdr[i];
+
+  return sum == expected;
+}
+
+static grub_err_t
+import_tar (struct import_ctx *ctx)
+{
+  grub_uint8_t hdr[TAR_BLOCK_SIZE];
+  char path[TAR_PREFIX_LEN + 1 + TAR_NAME_LEN + 1];
+  char *longname = NULL;
+  grub_off_t pos = 0;
+
+  for (;;)
+    {
+      grub_uint64_t size;
+      const char *name;
+      char typeflag;
+      int type;
+      unsigned int i;
+
+      /* some writers leave the zero blocks out, so the end of the file
+	 on a header boundary ends the archive too */
+      if (!longname && pos >= grub_file_size (ctx->archive))
+	break;
+
+      if (read_at (ctx->archive, pos, hdr, sizeof (hdr)))
+	break;
+
+      /* the archive ends with zero blocks */
+      for (i = 0; i < TAR_BLOCK_SIZE && hdr[i] == 0; i++)
+	;
+      if (i == TAR_BLOCK_SIZE)
+	break;
+
+      if (grub_memcmp (hdr + TAR_MAGIC_OFF, "ustar", 5) != 0
+	  || !tar_checksum_ok (hdr)
+	  || !parse_number ((char *) hdr + TAR_SIZE_OFF, TAR_SIZE_LEN, 8,
+			    &size))
+	{
+	  grub_error (GRUB_ERR_BAD_FILE_TYPE, N_ ("invalid tar header"));
+	  break;
+	}
+
+      typeflag = hdr[TAR_TYPE_OFF];
+      pos += TAR_BLOCK_SIZE;
+
+      /* GNU long name, it applies to the next entry */
+      if (typeflag == 'L')
+	{
+	  grub_free (longname);
+	  longname = grub_malloc (size + 1);
+	  if (!longname || read_at (ctx->archive, pos, longname, size))
+	    break;
+
+	  longname[size] = '\0';
+	  pos += ALIGN_UP (size, TAR_BLOCK_SIZE);
+	  continue;
+	}
+
+      if (longname)
+	name = longname;
+      else
+	{
+	  /* name and prefix aren't NUL terminated when they are full */
+	  grub_size_t off = 0;
+
+	  if (hdr[TAR_PREFIX_OFF])
+	    {
+	      for (i = 0; i < TAR_PREFIX_LEN && hdr[TAR_PREFIX_OFF + i]; i++)
+		path[off++] = hdr[TAR_PREFIX_OFF + i];
+	      path[off++] = '/';
+	    }
+
+	  for (i = 0; i < TAR_NAME_LEN && hdr[TAR_NAME_OFF + i]; i++)
+	    path[off++] = hdr[TAR_NAME_OFF + i];
+	  path[off] = '\0';
+	  name = path;
+	}
+
+      if (typeflag == '0' || typeflag == '\0' || typeflag == '7')
+	type = IMPORT_ENTRY_FILE;
+      else if (typeflag == '5')
+	type = IMPORT_ENTRY_DIR;
+      else
+	type = IMPORT_ENTRY_OTHER;
+
+      grub_file_seek (ctx->archive, pos);
+      if (add_entry (ctx, name, type, type == IMPORT_ENTRY_FILE ? size : 0))
+	break;
+
+      grub_free (longname);
+      longname = NULL;
+
+      pos += ALIGN_UP (size, TAR_BLOCK_SIZE);
+    }
+
+  grub_free (longname);
+  return grub_errno;
+}
+
+grub_err_t
+grub_vfs_import (struct grub_vfs_node *dir, grub_file_t archive)
+{
+  char magic[TAR_MAGIC_OFF + 5];
+  struct import_ctx ctx =
+  {
+    .root = dir,
+    .archive = archive
+  };
+
+  if (dir->type != GRUB_VFS_NODE_TYPE_DIRECTORY)
+    return grub_error (GRUB_ERR_BAD_ARGUMENT,
+		       N_ ("Destination is not a directory"));
+
+  if (read_at (archive, 0, magic, 6))
+    return grub_errno;
+
+  if (grub_memcmp (magic, "07070", 5) == 0)
+    import_cpio (&ctx);
+  else if (read_at (archive, 0, magic, sizeof (magic)) == GRUB_ERR_NONE
+	   && grub_memcmp (magic + TAR_MAGIC_OFF, "ustar", 5) == 0)
+    import_tar (&ctx);
+  else
+    grub_error (GRUB_ERR_BAD_FILE_TYPE, N_ ("unknown archive format"));
+
+  grub_free (ctx.last_dir);
+  return grub_errno;
+}
@@ -0,0 +1,65 @@
+/* overlay.c - the real directories under overlay directories.  */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2019  Free Software Foundation, Inc.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <grub/mm.h>
+#include <grub/misc.h>
+#include <grub/file.h>
+#include <grub/device.h>
+#include <grub/fs.h>
+#include "vfs.h"
+
+grub_err_t
+grub_vfs_lower_dir (const char *dir, grub_fs_dir_hook_t hook, void *hook_data)
+{
+  char *device_name;
+  grub_device_t device;
+  grub_fs_t fs;
+  const char *path;
+
+  /* the same way `ls' lists a directory, the device defaults to $root */
+  device_name = grub_file_get_device_name (dir);
+  if (grub_errno)
+    return grub_errno;
+
+  device = grub_device_open (device_name);
+  grub_free (device_name);
+  if (!device)
+    return grub_errno;
+
+  fs = grub_fs_probe (device);
+  if (!fs)
+    {
+      grub_device_close (device);
+      return grub_errno;
+    }
+
+  path = grub_strchr (dir, ')');
+  if (path)
+    path++;
+  else
+    path = dir;
+
+  if (*path == '\0')
+    path = "/";
+
+  fs->fs_dir (device, path, hook, hook_data);
+
+  grub_device_close (device);
+  return grub_errno;
+}
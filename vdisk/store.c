@@ -0,0 +1,242 @@
+/* store.c - the chunks shared by the memory files of all the vfs.  */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2019  Free Software Foundation, Inc.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <grub/mm.h>
+#include <grub/misc.h>
+#include "vfs.h"
+
+/*
+ * Full chunks are kept once, whatever node or vfs they belong to. A blob
+ * is found by the hash of its plain contents and is never modified while
+ * it is shared, writing to a chunk gives the node a private copy first.
+ */
+struct grub_vfs_blob
+{
+  /* hash chain */
+  struct grub_vfs_blob *next;
+
+  grub_uint32_t hash;
+  grub_uint32_t refcount;
+
+  /* The size of DATA if it is compressed, 0 if it is not */
+  grub_uint32_t csize;
+
+  grub_uint8_t *data;
+};
+
+static struct grub_vfs_blob **store;
+static grub_size_t store_size;
+static grub_size_t nblobs;
+
+/* The memory of the data of all the blobs */
+static grub_size_t store_bytes;
+
+/* FNV-1a over 32-bit words, a chunk is a whole number of words */
+static grub_uint32_t
+hash_chunk (const grub_uint8_t *data)
+{
+  grub_uint32_t hash = 2166136261U;
+  grub_size_t i;
+
+  for (i = 0; i < GRUB_VFS_CHUNK_SIZE; i += 4)
+    {
+      grub_uint32_t word;
+
+      grub_memcpy (&word, data + i, sizeof (word));
+      hash ^= word;
+      hash *= 16777619U;
+    }
+
+  return hash ^ (hash >> 15);
+}
+
+/* Keep the chains at one blob on average */
+static void
+grow_store (void)
+{
+  grub_size_t size = store_size ? store_size * 2 : 256;
+  struct grub_vfs_blob **table;
+  grub_size_t i;
+
+  table = grub_zalloc (size * sizeof (table[0]));
+  if (!table)
+    {
+      /* longer chains are still correct */
+      grub_errno = GRUB_ERR_NONE;
+      return;
+    }
+
+  for (i = 0; i < store_size; i++)
+    while (store[i])
+      {
+	struct grub_vfs_blob *blob = store[i];
+
+	store[i] = blob->next;
+	blob->next = table[blob->hash & (size - 1)];
+	table[blob->hash & (size - 1)] = blob;
+      }
+
+  grub_free (store);
+  store = table;
+  store_size = size;
+}
+
+/* Compress the contents of BLOB, if it is worth it */
+static void
+compress_blob (struct grub_vfs_blob *blob)
+{
+  static grub_uint8_t buf[GRUB_VFS_CHUNK_SIZE];
+  grub_size_t csize;
+  grub_uint8_t *data;
+
+  if (blob->csize)
+    return;
+
+  /* keep the chunk plain unless it shrinks by an eighth at least */
+  csize = grub_vfs_compress (blob->data, GRUB_VFS_CHUNK_SIZE, buf,
+			     GRUB_VFS_CHUNK_SIZE - GRUB_VFS_CHUNK_SIZE / 8);
+  if (csize == 0)
+    return;
+
+  data = grub_malloc (csize);
+  if (!data)
+    {
+      grub_errno = GRUB_ERR_NONE;
+      return;
+    }
+
+  grub_memcpy (data, buf, csize);
+  grub_free (blob->data);
+  blob->data = data;
+  blob->csize = csize;
+  store_bytes -= GRUB_VFS_CHUNK_SIZE - csize;
+}
+
+struct grub_vfs_blob *
+grub_vfs_store_intern (grub_uint8_t *data, int compress)
+{
+  grub_uint32_t hash = hash_chunk (data);
+  struct grub_vfs_blob *blob;
+
+  if (store_size)
+    for (blob = store[hash & (store_size - 1)]; blob; blob = blob->next)
+      {
+	const grub_uint8_t *contents;
+
+	if (blob->hash != hash)
+	  continue;
+
+	contents = grub_vfs_store_data (blob);
+	if (!contents)
+	  return NULL;
+
+	if (grub_memcmp (contents, data, GRUB_VFS_CHUNK_SIZE) == 0)
+	  {
+	    if (compress)
+	      compress_blob (blob);
+
+	    blob->refcount++;
+	    grub_free (data);
+	    return blob;
+	  }
+      }
+
+  if (nblobs >= store_size)
+    grow_store ();
+  if (!store_size)
+    return NULL;
+
+  blob = grub_malloc (sizeof (*blob));
+  if (!blob)
+    return NULL;
+
+  /* the blob takes over DATA */
+  blob->hash = hash;
+  blob->refcount = 1;
+  blob->csize = 0;
+  blob->data = data;
+  store_bytes += GRUB_VFS_CHUNK_SIZE;
+  if (compress)
+    compress_blob (blob);
+
+  blob->next = store[hash & (store_size - 1)];
+  store[hash & (store_size - 1)] = blob;
+  nblobs++;
+
+  return blob;
+}
+
+const grub_uint8_t *
+grub_vfs_store_data (struct grub_vfs_blob *blob)
+{
+  if (blob->csize)
+    return grub_vfs_zcache_get (blob->data, blob->csize);
+
+  return blob->data;
+}
+
+void
+grub_vfs_store_compress (struct grub_vfs_blob *blob)
+{
+  compress_blob (blob);
+}
+
+void
+grub_vfs_store_put (struct grub_vfs_blob *blob)
+{
+  struct grub_vfs_blob **p;
+
+  if (--blob->refcount > 0)
+    return;
+
+  for (p = &store[blob->hash & (store_size - 1)]; *p; p = &(*p)->next)
+    if (*p == blob)
+      {
+	*p = blob->next;
+	break;
+      }
+
+  if (blob->csize)
+    grub_vfs_zcache_forget (blob->data);
+
+  store_bytes -= blob->csize ? blob->csize : GRUB_VFS_CHUNK_SIZE;
+  grub_free (blob->data);
+  grub_free (blob);
+
+  /* the table goes away with the last blob */
+  if (--nblobs == 0)
+    {
+      grub_free (store);
+      store = NULL;
+      store_size = 0;
+    }
+}
+
+grub_uint32_t
+grub_vfs_store_refcount (struct grub_vfs_blob *blob)
+{
+  return blob->refcount;
+}
+
+void
+grub_vfs_store_stats (grub_size_t *count, grub_size_t *size)
+{
+  *count = nblobs;
+  *size = store_bytes;
+}
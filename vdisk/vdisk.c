@@ -20,11 +20,15 @@
 #include <grub/mm.h>
 #include <grub/misc.h>
 #include <grub/file.h>
+#include <grub/disk.h>
 #include <grub/dl.h>
 #include "vfs.h"
 
 static struct grub_vfs *fs_list = NULL;
 
+/* The disk id of the next vfs */
+static unsigned long last_vfs_id = 0;
+
 /* Check whether the name is available */
 static int
 check_vfs_name (const char *name)
@@ -63,8 +67,8 @@ push_vfs (struct grub_vfs *vfs)
     {
       vfs->prev = fs_list;
       vfs->next = fs_list->next;
-      fs_list->next = vfs;
       fs_list->next->prev = vfs;
+      fs_list->next = vfs;
     }
 }
 
@@ -90,6 +94,135 @@ remove_vfs (struct grub_vfs *vfs)
     }
 }
 
+/* Account for DELTA bytes of memory held by VFS */
+static void
+account_mem (struct grub_vfs *vfs, grub_ssize_t delta)
+{
+  vfs->stats.mem += delta;
+  if (vfs->stats.mem > vfs->stats.peak_mem)
+    vfs->stats.peak_mem = vfs->stats.mem;
+}
+
+/* Size of the children index when the first child is pushed */
+#define VFS_INDEX_INIT_SIZE 16
+
+/* FNV-1a hash of the lower-cased name, names are case insensitive */
+static grub_uint32_t
+hash_name (const char *name)
+{
+  grub_uint32_t hash = 2166136261U;
+
+  for (; *name != '\0'; name++)
+    {
+      hash ^= (grub_uint8_t) grub_tolower (*name);
+      hash *= 16777619U;
+    }
+
+  return hash;
+}
+
+/* Find the index slot of NAME under NODE, or the empty slot ending
+   its probe sequence */
+static grub_size_t
+index_slot (struct grub_vfs_node *node, const char *name, grub_uint32_t hash)
+{
+  grub_size_t mask = node->index_size - 1;
+  grub_size_t i = hash & mask;
+
+  while (node->index[i] != NULL)
+    {
+      if (node->index[i]->hash == hash
+	  && grub_strcasecmp (node->index[i]->name, name) == 0)
+	break;
+
+      i = (i + 1) & mask;
+    }
+
+  return i;
+}
+
+/* Make room in the index of NODE for COUNT more children */
+static grub_err_t
+index_reserve (struct grub_vfs_node *node, grub_size_t count)
+{
+  struct grub_vfs_node **old_index = node->index;
+  grub_size_t old_size = node->index_size;
+  grub_size_t size = old_size ? old_size : VFS_INDEX_INIT_SIZE;
+  grub_size_t i;
+
+  /* keep the load factor at most 1/2 so that probe sequences stay short */
+  while ((node->nchildren + count) * 2 > size)
+    size <<= 1;
+
+  if (size == old_size)
+    return GRUB_ERR_NONE;
+
+  node->index = grub_zalloc (size * sizeof (node->index[0]));
+  if (!node->index)
+    {
+      node->index = old_index;
+      return grub_error (GRUB_ERR_OUT_OF_MEMORY, N_ ("out of memory"));
+    }
+  node->index_size = size;
+  node->vfs->stats.reallocs++;
+  account_mem (node->vfs, (size - old_size) * sizeof (node->index[0]));
+
+  /* rehash the existing children */
+  for (i = 0; i < old_size; i++)
+    if (old_index[i] != NULL)
+      node->index[index_slot (node, old_index[i]->name,
+			      old_index[i]->hash)] = old_index[i];
+
+  grub_free (old_index);
+  return GRUB_ERR_NONE;
+}
+
+static void
+index_remove (struct grub_vfs_node *parent, struct grub_vfs_node *node)
+{
+  grub_size_t mask = parent->index_size - 1;
+  grub_size_t i, j;
+
+  if (parent->index == NULL)
+    return;
+
+  i = index_slot (parent, node->name, node->hash);
+  if (parent->index[i] != node)
+    return;
+
+  parent->index[i] = NULL;
+
+  /* shift the rest of the cluster back, so no probe sequence is broken */
+  for (j = (i + 1) & mask; parent->index[j] != NULL; j = (j + 1) & mask)
+    {
+      grub_size_t home = parent->index[j]->hash & mask;
+
+      /* move the entry unless its home slot is cyclically in (i, j] */
+      if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
+	{
+	  parent->index[i] = parent->index[j];
+	  parent->index[j] = NULL;
+	  i = j;
+	}
+    }
+}
+
+/* Find the child of NODE called NAME */
+static struct grub_vfs_node *
+find_child (struct grub_vfs_node *node, const char *name)
+{
+  struct grub_vfs_node *child = NULL;
+
+  if (node->children != NULL && node->index != NULL)
+    child = node->index[index_slot (node, name, hash_name (name))];
+
+  node->vfs->stats.lookups++;
+  if (!child)
+    node->vfs->stats.lookup_misses++;
+
+  return child;
+}
+
 static int
 check_node_name (struct grub_vfs_node *node, const char *name)
 {
@@ -101,25 +234,15 @@ check_node_name (struct grub_vfs_node *node, const char *name)
   if (grub_strcmp (name, ".") == 0 || grub_strcmp (name, "..") == 0)
     return 0;
 
-  /* iterate the whole linked list */
-  struct grub_vfs_node *start = node->children;
-  struct grub_vfs_node *current = start;
-
-  do
-    {
-      if (grub_strcasecmp (name, current->name) == 0)
-	return 0;
-
-      current = current->next;
-    }
-  while (current != start);
-
-  return 1;
+  return find_child (node, name) == NULL;
 }
 
-static void
+static grub_err_t
 push_node (struct grub_vfs_node *parent, struct grub_vfs_node *node)
 {
+  if (index_reserve (parent, 1))
+    return grub_errno;
+
   if (parent->children == NULL)
     {
       node->next = node;
@@ -130,16 +253,32 @@ push_node (struct grub_vfs_node *parent, struct grub_vfs_node *node)
     {
       node->prev = parent->children;
       node->next = parent->children->next;
-      parent->children->next = node;
       parent->children->next->prev = node;
+      parent->children->next = node;
     }
   node->parent = parent;
+
+  parent->index[index_slot (parent, node->name, node->hash)] = node;
+  parent->nchildren++;
+
+  return GRUB_ERR_NONE;
 }
 
 static void
 remove_node (struct grub_vfs_node *node)
 {
   struct grub_vfs_node *parent = node->parent;
+
+  /* the node has not been pushed into any directory */
+  if (node->next == NULL)
+    return;
+
+  if (parent)
+    {
+      index_remove (parent, node);
+      parent->nchildren--;
+    }
+
   if (node->next == node)
     {
       node->next = NULL;
@@ -159,6 +298,456 @@ remove_node (struct grub_vfs_node *node)
     }
 }
 
+/* Free the data of CHUNK of NODE, or drop its share */
+static void
+free_chunk (struct grub_vfs_node *node, struct grub_vfs_chunk *chunk)
+{
+  if (chunk->blob)
+    grub_vfs_store_put (chunk->blob);
+
+  if (chunk->data)
+    account_mem (node->vfs, -GRUB_VFS_CHUNK_SIZE);
+
+  grub_free (chunk->data);
+  chunk->data = NULL;
+  chunk->blob = NULL;
+}
+
+/* Get the contents of chunk IDX of NODE for reading */
+static const grub_uint8_t *
+chunk_data (struct grub_vfs_node *node, grub_size_t idx)
+{
+  struct grub_vfs_chunk *chunk = &node->chunks[idx];
+
+  if (chunk->blob)
+    return grub_vfs_store_data (chunk->blob);
+
+  return chunk->data;
+}
+
+/* Get the contents of chunk IDX of NODE for writing, a shared chunk is
+   copied first */
+static grub_uint8_t *
+chunk_data_rw (struct grub_vfs_node *node, grub_size_t idx)
+{
+  struct grub_vfs_chunk *chunk = &node->chunks[idx];
+  const grub_uint8_t *contents;
+  grub_uint8_t *data;
+
+  if (!chunk->blob)
+    return chunk->data;
+
+  contents = grub_vfs_store_data (chunk->blob);
+  if (!contents)
+    return NULL;
+
+  data = grub_malloc (GRUB_VFS_CHUNK_SIZE);
+  if (!data)
+    return NULL;
+
+  grub_memcpy (data, contents, GRUB_VFS_CHUNK_SIZE);
+  free_chunk (node, chunk);
+  chunk->data = data;
+  account_mem (node->vfs, GRUB_VFS_CHUNK_SIZE);
+
+  return data;
+}
+
+/* Move chunk IDX of the memory file NODE to the store once it is full,
+   so identical chunks are kept once */
+static void
+seal_chunk (struct grub_vfs_node *node, grub_size_t idx)
+{
+  struct grub_vfs_chunk *chunk = &node->chunks[idx];
+  struct grub_vfs_blob *blob;
+
+  if (node->type != GRUB_VFS_NODE_TYPE_MEMORY_FILE)
+    return;
+
+  if (chunk->blob)
+    {
+      if (node->vfs->compress)
+	grub_vfs_store_compress (chunk->blob);
+      return;
+    }
+
+  if (!chunk->data
+      || ((grub_off_t) idx + 1) << GRUB_VFS_CHUNK_SHIFT > node->len)
+    return;
+
+  blob = grub_vfs_store_intern (chunk->data, node->vfs->compress);
+  if (!blob)
+    {
+      /* the private chunk is still there */
+      grub_errno = GRUB_ERR_NONE;
+      return;
+    }
+
+  chunk->data = NULL;
+  chunk->blob = blob;
+  account_mem (node->vfs, -GRUB_VFS_CHUNK_SIZE);
+
+  if (grub_vfs_store_refcount (blob) > 1)
+    node->vfs->stats.shared_chunks++;
+}
+
+/* Seal the full chunks of NODE in the range of LEN bytes at POS */
+static void
+seal_range (struct grub_vfs_node *node, grub_off_t pos, grub_size_t len)
+{
+  grub_size_t idx;
+
+  if (len == 0)
+    return;
+
+  for (idx = pos >> GRUB_VFS_CHUNK_SHIFT;
+       idx <= (pos + len - 1) >> GRUB_VFS_CHUNK_SHIFT && idx < node->nchunks;
+       idx++)
+    seal_chunk (node, idx);
+}
+
+/* Make sure NODE has enough chunks to hold SIZE bytes */
+static grub_err_t
+reserve_chunks (struct grub_vfs_node *node, grub_size_t size)
+{
+  grub_size_t needed = ALIGN_UP (size, GRUB_VFS_CHUNK_SIZE)
+    >> GRUB_VFS_CHUNK_SHIFT;
+
+  if (needed > node->chunks_size)
+    {
+      /* grow the chunk index geometrically, so appends stay O(1) */
+      grub_size_t new_size = node->chunks_size ? node->chunks_size : 8;
+      struct grub_vfs_chunk *new_chunks;
+
+      while (new_size < needed)
+	new_size <<= 1;
+
+      new_chunks = grub_realloc (node->chunks,
+				 new_size * sizeof (node->chunks[0]));
+      if (!new_chunks)
+	return grub_error (GRUB_ERR_OUT_OF_MEMORY, N_ ("out of memory"));
+
+      node->vfs->stats.reallocs++;
+      account_mem (node->vfs,
+		   (new_size - node->chunks_size) * sizeof (node->chunks[0]));
+      node->chunks = new_chunks;
+      node->chunks_size = new_size;
+    }
+
+  while (node->nchunks < needed)
+    {
+      struct grub_vfs_chunk *chunk = &node->chunks[node->nchunks];
+
+      chunk->blob = NULL;
+      chunk->data = grub_malloc (GRUB_VFS_CHUNK_SIZE);
+      if (!chunk->data)
+	return grub_error (GRUB_ERR_OUT_OF_MEMORY, N_ ("out of memory"));
+
+      account_mem (node->vfs, GRUB_VFS_CHUNK_SIZE);
+      node->nchunks++;
+    }
+
+  return GRUB_ERR_NONE;
+}
+
+/* Free the chunks of NODE which are not needed to hold SIZE bytes */
+static void
+release_chunks (struct grub_vfs_node *node, grub_size_t size)
+{
+  grub_size_t needed = ALIGN_UP (size, GRUB_VFS_CHUNK_SIZE)
+    >> GRUB_VFS_CHUNK_SHIFT;
+
+  while (node->nchunks > needed)
+    free_chunk (node, &node->chunks[--node->nchunks]);
+
+  if (node->nchunks == 0)
+    {
+      account_mem (node->vfs, -node->chunks_size * sizeof (node->chunks[0]));
+      grub_free (node->chunks);
+      node->chunks = NULL;
+      node->chunks_size = 0;
+    }
+}
+
+/* Copy LEN bytes at offset POS of NODE from or to BUF */
+static grub_err_t
+copy_chunks (struct grub_vfs_node *node, grub_off_t pos, grub_uint8_t *buf,
+	     grub_size_t len, int write)
+{
+  while (len > 0)
+    {
+      grub_size_t idx = pos >> GRUB_VFS_CHUNK_SHIFT;
+      grub_size_t off = pos & (GRUB_VFS_CHUNK_SIZE - 1);
+      grub_size_t n = GRUB_VFS_CHUNK_SIZE - off;
+
+      if (n > len)
+	n = len;
+
+      if (write)
+	{
+	  grub_uint8_t *chunk = chunk_data_rw (node, idx);
+	  if (!chunk)
+	    return grub_errno;
+
+	  grub_memcpy (chunk + off, buf, n);
+	}
+      else
+	{
+	  const grub_uint8_t *chunk = chunk_data (node, idx);
+	  if (!chunk)
+	    return grub_errno;
+
+	  grub_memcpy (buf, chunk + off, n);
+	}
+
+      pos += n;
+      buf += n;
+      len -= n;
+    }
+
+  return GRUB_ERR_NONE;
+}
+
+/* Seal the chunks of the memory files under NODE */
+static void
+seal_tree (struct grub_vfs_node *node)
+{
+  grub_size_t idx;
+
+  for (idx = 0; idx < node->nchunks; idx++)
+    seal_chunk (node, idx);
+
+  if (node->children != NULL)
+    {
+      struct grub_vfs_node *start = node->children;
+      struct grub_vfs_node *current = start;
+
+      do
+	{
+	  seal_tree (current);
+	  current = current->next;
+	}
+      while (current != start);
+    }
+}
+
+/* Open the underlying file of the linked file NODE, unless it is open */
+static grub_err_t
+open_link (struct grub_vfs_node *node)
+{
+  if (node->file)
+    return GRUB_ERR_NONE;
+
+  node->file = grub_file_open (node->path_to_file, GRUB_FILE_TYPE_CAT);
+  if (!node->file)
+    {
+      grub_dprintf ("vfs", "unable to open the file `%s'\n",
+		    node->path_to_file);
+      return grub_errno ? grub_errno : GRUB_ERR_FILE_NOT_FOUND;
+    }
+
+  node->vfs->stats.file_opens++;
+
+  /* update the length of the file */
+  node->len = grub_file_size (node->file);
+
+  return GRUB_ERR_NONE;
+}
+
+/* Read LEN bytes at POS from the underlying file of NODE */
+static grub_ssize_t
+read_underlying (struct grub_vfs_node *node, grub_off_t pos, char *buf,
+		 grub_size_t len)
+{
+  if (!node->cache && node->vfs->cache_blocks)
+    {
+      node->cache = grub_vfs_cache_new (node->vfs->cache_blocks);
+      /* reading without a cache is fine too */
+      grub_errno = GRUB_ERR_NONE;
+    }
+
+  if (node->cache)
+    return grub_vfs_cache_read (node->cache, node->file, pos, buf, len,
+				&node->vfs->stats);
+
+  /* sequential reads leave the file where the next one starts */
+  if (grub_file_tell (node->file) != pos)
+    grub_file_seek (node->file, pos);
+
+  return grub_file_read (node->file, buf, len);
+}
+
+/* Get the private copy of chunk IDX of the linked file NODE, reading the
+   original contents on first use */
+static grub_uint8_t *
+link_chunk_copy (struct grub_vfs_node *node, grub_size_t idx)
+{
+  grub_off_t pos = (grub_off_t) idx << GRUB_VFS_CHUNK_SHIFT;
+  grub_uint8_t *chunk;
+
+  /* linked files only have the chunks which were written to */
+  if (node->chunks == NULL)
+    {
+      grub_size_t count = ALIGN_UP (node->len, GRUB_VFS_CHUNK_SIZE)
+	>> GRUB_VFS_CHUNK_SHIFT;
+
+      node->chunks = grub_zalloc (count * sizeof (node->chunks[0]));
+      if (!node->chunks)
+	{
+	  grub_error (GRUB_ERR_OUT_OF_MEMORY, N_ ("out of memory"));
+	  return NULL;
+	}
+      node->nchunks = node->chunks_size = count;
+      account_mem (node->vfs, count * sizeof (node->chunks[0]));
+    }
+
+  if (idx >= node->nchunks)
+    {
+      grub_error (GRUB_ERR_OUT_OF_RANGE, N_ ("attempt to write past the end of file"));
+      return NULL;
+    }
+
+  if (node->chunks[idx].data)
+    return node->chunks[idx].data;
+
+  chunk = grub_zalloc (GRUB_VFS_CHUNK_SIZE);
+  if (!chunk)
+    {
+      grub_error (GRUB_ERR_OUT_OF_MEMORY, N_ ("out of memory"));
+      return NULL;
+    }
+
+  if (read_underlying (node, pos, (char *) chunk, GRUB_VFS_CHUNK_SIZE) < 0)
+    {
+      grub_free (chunk);
+      return NULL;
+    }
+
+  node->chunks[idx].data = chunk;
+  account_mem (node->vfs, GRUB_VFS_CHUNK_SIZE);
+  return chunk;
+}
+
+/* Read LEN bytes at POS from the linked file NODE, taking the chunks
+   written to it into account */
+static grub_ssize_t
+read_link (struct grub_vfs_node *node, grub_off_t pos, char *buf,
+	   grub_size_t len)
+{
+  grub_ssize_t total = 0;
+
+  if (pos >= node->len)
+    return 0;
+
+  if (len > node->len - pos)
+    len = node->len - pos;
+
+  if (node->chunks == NULL)
+    return read_underlying (node, pos, buf, len);
+
+  while (len > 0)
+    {
+      grub_size_t idx = pos >> GRUB_VFS_CHUNK_SHIFT;
+      grub_size_t off = pos & (GRUB_VFS_CHUNK_SIZE - 1);
+      grub_size_t n = GRUB_VFS_CHUNK_SIZE - off;
+      grub_ssize_t got;
+
+      if (n > len)
+	n = len;
+
+      if (idx < node->nchunks && node->chunks[idx].data)
+	{
+	  grub_memcpy (buf, node->chunks[idx].data + off, n);
+	  got = n;
+	}
+      else
+	{
+	  got = read_underlying (node, pos, buf, n);
+	  if (got < 0)
+	    return got;
+	  if (got == 0)
+	    break;
+	}
+
+      pos += got;
+      buf += got;
+      len -= got;
+      total += got;
+    }
+
+  return total;
+}
+
+/* Detach the mapped node from the disk device of VFS */
+static void
+unmap_node (struct grub_vfs *vfs)
+{
+  vfs->mapped = NULL;
+
+  /* the sectors cached for the device are stale now */
+  grub_disk_cache_invalidate_all ();
+}
+
+/* Drop the read caches of the linked files under NODE */
+static void
+drop_caches (struct grub_vfs_node *node)
+{
+  grub_vfs_cache_free (node->cache);
+  node->cache = NULL;
+
+  if (node->children != NULL)
+    {
+      struct grub_vfs_node *start = node->children;
+      struct grub_vfs_node *current = start;
+
+      do
+	{
+	  drop_caches (current);
+	  current = current->next;
+	}
+      while (current != start);
+    }
+}
+
+/* Free what the node holds outside of the arena */
+static void
+release_node (struct grub_vfs_node *node)
+{
+  if (node->file)
+    grub_file_close (node->file);
+
+  grub_vfs_cache_free (node->cache);
+
+  release_chunks (node, 0);
+
+  account_mem (node->vfs, -node->index_size * sizeof (node->index[0]));
+  grub_free (node->index);
+
+  /* the paths are the node's own, unlike the interned name */
+  grub_free ((char *) node->path_to_file);
+  grub_free ((char *) node->lower);
+}
+
+/* Release the whole tree under NODE, the arena is released afterwards */
+static void
+release_tree (struct grub_vfs_node *node)
+{
+  if (node->children != NULL)
+    {
+      struct grub_vfs_node *start = node->children;
+      struct grub_vfs_node *current = start;
+
+      do
+	{
+	  release_tree (current);
+	  current = current->next;
+	}
+      while (current != start);
+    }
+
+  release_node (node);
+}
+
 /* Recursive destroy the node */
 static void
 destroy_node (struct grub_vfs_node *node)
@@ -170,41 +759,40 @@ destroy_node (struct grub_vfs_node *node)
 	destroy_node (node->children);
     }
 
+  if (node->vfs && node->vfs->mapped == node)
+    unmap_node (node->vfs);
+
   /* now remove the node */
   remove_node (node);
 
-  if (node->name)
-    grub_free (node->name);
-
-  if (node->path_to_file)
-    grub_free (node->path_to_file);
-
-  if (node->data)
-    grub_free (node->data);
+  release_node (node);
 
-  grub_free (node);
+  /* the name stays interned until the vfs goes away */
+  grub_vfs_arena_free_node (&node->vfs->arena, node);
 }
 
 /* allocate the memory and make a new node */
 static struct grub_vfs_node *
 make_node (struct grub_vfs *vfs, int type, const char *name)
 {
-  struct grub_vfs_node *node = grub_zalloc (sizeof(struct grub_vfs_node));
+  struct grub_vfs_node *node = grub_vfs_arena_node (&vfs->arena);
   if (!node)
     {
       grub_error (GRUB_ERR_OUT_OF_MEMORY, N_ ("out of memory"));
       return NULL;
     }
 
-  node->name = grub_strdup (name);
+  node->name = grub_vfs_arena_intern (&vfs->arena, name);
   if (!node->name)
     {
-      grub_free (node);
+      grub_vfs_arena_free_node (&vfs->arena, node);
+      grub_error (GRUB_ERR_OUT_OF_MEMORY, N_ ("out of memory"));
       return NULL;
     }
 
   node->vfs = vfs;
   node->type = type;
+  node->hash = hash_name (name);
 
   return node;
 }
@@ -227,7 +815,7 @@ grub_vfs_create (const char *name, struct grub_vfs **vfs)
     return grub_error (GRUB_ERR_OUT_OF_MEMORY, N_ ("out of memory"));
 
   /* create the root node */
-  root_node = grub_zalloc (sizeof(struct grub_vfs_node));
+  root_node = grub_vfs_arena_node (&fs->arena);
   if (!root_node)
     {
       grub_free (fs->name);
@@ -238,6 +826,7 @@ grub_vfs_create (const char *name, struct grub_vfs **vfs)
   root_node->type = GRUB_VFS_NODE_TYPE_DIRECTORY;
   root_node->vfs = fs;
   fs->root = root_node;
+  fs->id = last_vfs_id++;
 
   push_vfs (fs);
   *vfs = fs;
@@ -272,8 +861,15 @@ grub_vfs_get (const char *name, struct grub_vfs **vfs)
 void
 grub_vfs_destroy (struct grub_vfs *vfs)
 {
+  if (vfs->mapped)
+    unmap_node (vfs);
+
   remove_vfs (vfs);
-  destroy_node (vfs->root);
+
+  /* the nodes themselves go with the arena, at once */
+  release_tree (vfs->root);
+  grub_vfs_arena_release (&vfs->arena);
+
   grub_free (vfs->name);
   grub_free (vfs);
 }
@@ -328,8 +924,11 @@ grub_vfs_mkfile (struct grub_vfs_node *node, const char *filename,
     {
       grub_file_t file = grub_file_open (underlying_file, GRUB_FILE_TYPE_CAT);
       if (!file)
-	return grub_error (GRUB_ERR_ACCESS_DENIED, N_ (
-			     "unable to open the file"));
+	{
+	  destroy_node (file_node);
+	  return grub_error (GRUB_ERR_ACCESS_DENIED, N_ (
+			       "unable to open the file"));
+	}
       file_node->len = grub_file_size (file);
       grub_file_close (file);
 
@@ -341,7 +940,12 @@ grub_vfs_mkfile (struct grub_vfs_node *node, const char *filename,
 	}
     }
 
-  push_node (node, file_node);
+  if (push_node (node, file_node))
+    {
+      destroy_node (file_node);
+      return grub_errno;
+    }
+
   return GRUB_ERR_NONE;
 }
 
@@ -362,7 +966,121 @@ grub_vfs_mkdir (struct grub_vfs_node *node, const char *name)
   if (!dir_node)
     return grub_error (GRUB_ERR_OUT_OF_MEMORY, N_ ("out of memory"));
 
-  push_node (node, dir_node);
+  if (push_node (node, dir_node))
+    {
+      destroy_node (dir_node);
+      return grub_errno;
+    }
+
+  return GRUB_ERR_NONE;
+}
+
+struct merge_data
+{
+  struct grub_vfs_node *dir;
+  grub_err_t err;
+};
+
+/* Add an entry of the real directory to the overlay directory, unless the
+   vfs has one of the same name */
+static int
+merge_hook (const char *name, const struct grub_dirhook_info *info,
+	    void *hook_data)
+{
+  struct merge_data *data = hook_data;
+  struct grub_vfs_node *dir = data->dir;
+  struct grub_vfs_node *node;
+  grub_size_t len = grub_strlen (dir->lower);
+  grub_size_t size = len + grub_strlen (name) + 2;
+  char *path;
+
+  if (grub_strcmp (name, ".") == 0 || grub_strcmp (name, "..") == 0)
+    return 0;
+
+  /* the vfs hides the real entries */
+  if (find_child (dir, name))
+    return 0;
+
+  path = grub_malloc (size);
+  if (!path)
+    {
+      data->err = grub_error (GRUB_ERR_OUT_OF_MEMORY, N_ ("out of memory"));
+      return 1;
+    }
+
+  if (len > 0 && dir->lower[len - 1] == '/')
+    grub_snprintf (path, size, "%s%s", dir->lower, name);
+  else
+    grub_snprintf (path, size, "%s/%s", dir->lower, name);
+
+  /* files are linked files, opened on their first open. Directories are
+     overlays in turn, merged on their first lookup */
+  node = make_node (dir->vfs, info->dir ? GRUB_VFS_NODE_TYPE_DIRECTORY
+		    : GRUB_VFS_NODE_TYPE_LINK_FILE, name);
+  if (!node)
+    {
+      grub_free (path);
+      data->err = grub_errno;
+      return 1;
+    }
+
+  if (info->dir)
+    node->lower = path;
+  else
+    node->path_to_file = path;
+
+  if (push_node (dir, node))
+    {
+      destroy_node (node);
+      data->err = grub_errno;
+      return 1;
+    }
+
+  return 0;
+}
+
+/* Merge the real directory under the overlay directory DIR, once */
+static grub_err_t
+merge_lower (struct grub_vfs_node *dir)
+{
+  struct merge_data data =
+  {
+    .dir = dir,
+    .err = GRUB_ERR_NONE
+  };
+
+  if (!dir->lower || dir->lower_merged)
+    return GRUB_ERR_NONE;
+
+  /* set first: a lower directory on this vfs itself merges DIR again */
+  dir->lower_merged = 1;
+
+  if (grub_vfs_lower_dir (dir->lower, merge_hook, &data) == GRUB_ERR_NONE
+      && data.err == GRUB_ERR_NONE)
+    return GRUB_ERR_NONE;
+
+  dir->lower_merged = 0;
+  return data.err ? data.err : grub_errno;
+}
+
+grub_err_t
+grub_vfs_overlay (struct grub_vfs_node *node, const char *lower)
+{
+  char *copy;
+
+  if (node->type != GRUB_VFS_NODE_TYPE_DIRECTORY)
+    return grub_error (GRUB_ERR_BAD_ARGUMENT,
+		       N_ ("Destination is not a directory"));
+
+  copy = grub_strdup (lower);
+  if (!copy)
+    return grub_error (GRUB_ERR_OUT_OF_MEMORY, N_ ("out of memory"));
+
+  /* the entries merged from a previous directory stay */
+  grub_free ((char *) node->lower);
+  node->lower = copy;
+  node->lower_merged = 0;
+
   return GRUB_ERR_NONE;
 }
 
@@ -370,6 +1088,9 @@ grub_err_t
 grub_vfs_dir (struct grub_vfs_node *node, grub_vfs_dir_hook_func_t hook,
 	      void *hook_data)
 {
+  if (merge_lower (node))
+    return grub_errno;
+
   if (node->children == NULL)
     {
       return GRUB_ERR_NONE;
@@ -392,22 +1113,24 @@ grub_err_t
 grub_vfs_lookup (struct grub_vfs_node *node, const char *filename,
 		 struct grub_vfs_node **found_node)
 {
-  if (node->children == NULL)
-    return GRUB_ERR_FILE_NOT_FOUND;
+  struct grub_vfs_node *found;
 
-  struct grub_vfs_node *start = node->children;
-  struct grub_vfs_node *current = start;
+  found = find_child (node, filename);
 
-  do
+  /* the real directory is only looked at on a miss */
+  if (!found && node->lower && !node->lower_merged)
     {
-      if (grub_strcasecmp (current->name, filename) == 0)
-	{
-	  *found_node = current;
-	  return GRUB_ERR_NONE;
-	}
-      current = current->next;
+      if (merge_lower (node))
+	return grub_errno;
+
+      found = find_child (node, filename);
+    }
+
+  if (found)
+    {
+      *found_node = found;
+      return GRUB_ERR_NONE;
     }
-  while (current != start);
 
   grub_dprintf("vfs", "node `%s' not found\n", filename);
   return grub_error(GRUB_ERR_FILE_NOT_FOUND, "node `%s' not found\n", filename);
@@ -446,17 +1169,28 @@ grub_vfs_mv (struct grub_vfs_node *src, struct grub_vfs_node *dest,
     return grub_error (GRUB_ERR_BAD_FILE_TYPE,
 		       N_ ("Destination is not a directory"));
 
+  /* the node and its name live in the arena of their vfs */
+  if (dest->vfs != src->vfs)
+    return grub_error (GRUB_ERR_BAD_ARGUMENT,
+		       N_ ("can't move across virtual file systems"));
+
   if (!check_node_name (dest, filename))
     return grub_error (GRUB_ERR_BAD_FILENAME, N_ ("The name has been taken."));
 
-  char *_name = grub_strdup (filename);
+  const char *_name = grub_vfs_arena_intern (&src->vfs->arena, filename);
   if (!_name)
     return grub_error (GRUB_ERR_OUT_OF_MEMORY, N_ ("out of memory"));
 
-  grub_free (src->name);
-  src->name = _name;
+  /* reserve the slot first, so the node can't get lost on the way */
+  if (index_reserve (dest, 1))
+    return grub_errno;
 
+  /* the old name is still needed to find the node in the index */
   remove_node (src);
+
+  src->name = _name;
+  src->hash = hash_name (_name);
+
   push_node (dest, src);
 
   return 0;
@@ -476,16 +1210,11 @@ grub_vfs_open (struct grub_vfs_node *node)
   _ctx->node = node;
   if (node->path_to_file)
     {
-      _ctx->file = grub_file_open (node->path_to_file, GRUB_FILE_TYPE_CAT);
-      if (!_ctx->file)
-	{
-	  grub_dprintf ("vfs", "unable to open the file `%s'\n",
-			node->path_to_file);
-	  goto fail;
-	}
+      /* the underlying file is opened once and shared by all contexts */
+      if (open_link (node))
+	goto fail;
 
-      /* update the length of the file */
-      node->len = grub_file_size (_ctx->file);
+      _ctx->file = node->file;
     }
 
   return _ctx;
@@ -501,8 +1230,6 @@ grub_off_t
 grub_vfs_seek (struct grub_vfs_ctx *ctx, grub_off_t pos)
 {
   grub_off_t old;
-  if (ctx->file)
-    return grub_file_seek (ctx->file, pos);
 
   if (pos > ctx->node->len)
     {
@@ -517,21 +1244,48 @@ grub_vfs_seek (struct grub_vfs_ctx *ctx, grub_off_t pos)
   return old;
 }
 
+/* Count a read of LEN bytes of NODE */
+static void
+count_read (struct grub_vfs_node *node, grub_size_t len)
+{
+  node->stats.reads++;
+  node->stats.bytes_read += len;
+  node->vfs->stats.reads++;
+  node->vfs->stats.bytes_read += len;
+}
+
+/* Count a write of LEN bytes to NODE */
+static void
+count_write (struct grub_vfs_node *node, grub_size_t len)
+{
+  node->stats.writes++;
+  node->stats.bytes_written += len;
+  node->vfs->stats.writes++;
+  node->vfs->stats.bytes_written += len;
+}
+
 grub_ssize_t
-grub_vfs_read (struct grub_vfs_ctx *ctx, char *buf, grub_size_t len)
+grub_vfs_pread (struct grub_vfs_node *node, grub_off_t pos, char *buf,
+		grub_size_t len)
 {
-  if (ctx->file)
-    /* Read the underyling file */
-    return grub_file_read (ctx->file, buf, len);
+  grub_ssize_t got;
+
+  if (node->path_to_file)
+    {
+      /* Read the underyling file, shared by all the contexts */
+      if (open_link (node))
+	return -1;
+
+      got = read_link (node, pos, buf, len);
+    }
   else
     {
       /* Read our virtual file */
-      if (ctx->pos > ctx->node->len)
-	/* Attempt to read past the end of file */
-	return -1;
+      if (pos >= node->len)
+	return 0;
 
-      if (len > ctx->node->len - ctx->pos)
-	len = ctx->node->len - ctx->pos;
+      if (len > node->len - pos)
+	len = node->len - pos;
 
       /* Prevent an overflow.  */
       if ((grub_ssize_t) len < 0)
@@ -540,11 +1294,27 @@ grub_vfs_read (struct grub_vfs_ctx *ctx, char *buf, grub_size_t len)
       if (len == 0)
 	return 0;
 
-      /* try to read the file */
-      grub_memcpy (buf, ctx->node->data + ctx->pos, len);
-      ctx->pos += len;
-      return len;
+      if (copy_chunks (node, pos, (grub_uint8_t *) buf, len, 0))
+	return -1;
+
+      got = len;
     }
+
+  if (got > 0)
+    count_read (node, got);
+
+  return got;
+}
+
+grub_ssize_t
+grub_vfs_read (struct grub_vfs_ctx *ctx, char *buf, grub_size_t len)
+{
+  grub_ssize_t got = grub_vfs_pread (ctx->node, ctx->pos, buf, len);
+
+  if (got > 0)
+    ctx->pos += got;
+
+  return got;
 }
 
 grub_ssize_t
@@ -558,25 +1328,22 @@ grub_vfs_write (struct grub_vfs_ctx *ctx, char *buf, grub_size_t len)
     return 0;
 
   /* Write to our virtual file */
-  if (ctx->pos + len > ctx->node->len)
-    {
-      void *new_mem = NULL;
+  if (ctx->pos + len > ctx->node->len
+      && reserve_chunks (ctx->node, ctx->pos + len))
+    goto fail;
 
-      /* We need to realloc the memory */
-      if (ctx->node->data)
-	new_mem = grub_realloc (ctx->node->data, ctx->pos + len);
-      else
-	new_mem = grub_malloc (ctx->pos + len);
+  if (copy_chunks (ctx->node, ctx->pos, (grub_uint8_t *) buf, len, 1))
+    goto fail;
+  ctx->pos += len;
 
-      if (!new_mem)
-	goto fail;
+  if (ctx->node->vfs->mapped == ctx->node)
+    grub_disk_cache_invalidate_all ();
 
-      ctx->node->data = new_mem;
-      ctx->node->len = ctx->pos + len;
-    }
+  if (ctx->pos > ctx->node->len)
+    ctx->node->len = ctx->pos;
 
-  grub_memcpy (ctx->node->data + ctx->pos, buf, len);
-  ctx->pos += len;
+  seal_range (ctx->node, ctx->pos - len, len);
+  count_write (ctx->node, len);
 
   return len;
 fail:
@@ -587,30 +1354,260 @@ fail:
 grub_err_t
 grub_vfs_trunc (struct grub_vfs_ctx *ctx, grub_size_t len)
 {
+  struct grub_vfs_node *node = ctx->node;
+
   if (ctx->file)
     /* If the node is backed by a file, don't truncate it */
     return -1;
 
-  void *new_mem = grub_realloc (ctx->node->data, len);
-  if (!new_mem)
-    return grub_error (GRUB_ERR_OUT_OF_MEMORY, N_ ("out of memory"));
+  if (len > node->len)
+    {
+      grub_size_t old_len = node->len;
+      grub_size_t pos = node->len;
+      grub_uint8_t *chunk;
+
+      if (reserve_chunks (node, len))
+	return grub_errno;
+
+      /* the file is extended with zeros */
+      while (pos < len)
+	{
+	  grub_size_t off = pos & (GRUB_VFS_CHUNK_SIZE - 1);
+	  grub_size_t n = GRUB_VFS_CHUNK_SIZE - off;
+
+	  if (n > len - pos)
+	    n = len - pos;
 
-  ctx->node->data = new_mem;
-  ctx->node->len = len;
+	  chunk = chunk_data_rw (node, pos >> GRUB_VFS_CHUNK_SHIFT);
+	  if (!chunk)
+	    return grub_errno;
+
+	  grub_memset (chunk + off, 0, n);
+	  pos += n;
+	}
+
+      node->len = len;
+      seal_range (node, old_len, len - old_len);
+    }
+  else
+    /* whole chunks past the end are given back */
+    release_chunks (node, len);
+
+  node->len = len;
+
+  if (node->vfs->mapped == node)
+    grub_disk_cache_invalidate_all ();
 
   return 0;
 }
 
+grub_err_t
+grub_vfs_map (struct grub_vfs *vfs, struct grub_vfs_node *node)
+{
+  if (node && node->type == GRUB_VFS_NODE_TYPE_DIRECTORY)
+    return grub_error (GRUB_ERR_BAD_FILE_TYPE, N_ ("not a regular file"));
+
+  if (node && node->vfs != vfs)
+    return grub_error (GRUB_ERR_BAD_ARGUMENT,
+		       N_ ("the node belongs to another vfs"));
+
+  if (node && node->path_to_file && open_link (node))
+    return grub_errno;
+
+  unmap_node (vfs);
+  vfs->mapped = node;
+
+  return GRUB_ERR_NONE;
+}
+
+grub_err_t
+grub_vfs_map_read (struct grub_vfs *vfs, grub_off_t pos, char *buf,
+		   grub_size_t len)
+{
+  struct grub_vfs_node *node = vfs->mapped;
+  grub_size_t avail = 0;
+
+  if (!node)
+    return grub_error (GRUB_ERR_OUT_OF_RANGE, N_ ("no file is mapped"));
+
+  if (pos < node->len)
+    avail = node->len - pos < len ? node->len - pos : len;
+
+  if (avail > 0)
+    {
+      if (node->file)
+	{
+	  if (read_link (node, pos, buf, avail)
+	      != (grub_ssize_t) avail)
+	    return grub_errno ? grub_errno
+	      : grub_error (GRUB_ERR_READ_ERROR, N_ ("premature end of file"));
+	}
+      else if (copy_chunks (node, pos, (grub_uint8_t *) buf, avail, 0))
+	return grub_errno;
+
+      count_read (node, avail);
+    }
+
+  /* the last sector is padded with zeros */
+  grub_memset (buf + avail, 0, len - avail);
+
+  return GRUB_ERR_NONE;
+}
+
+grub_err_t
+grub_vfs_map_write (struct grub_vfs *vfs, grub_off_t pos, const char *buf,
+		    grub_size_t len)
+{
+  struct grub_vfs_node *node = vfs->mapped;
+
+  if (!node)
+    return grub_error (GRUB_ERR_OUT_OF_RANGE, N_ ("no file is mapped"));
+
+  /* the padding of the last sector is dropped */
+  if (pos >= node->len)
+    return GRUB_ERR_NONE;
+
+  if (len > node->len - pos)
+    len = node->len - pos;
+
+  count_write (node, len);
+
+  if (!node->file)
+    {
+      if (copy_chunks (node, pos, (grub_uint8_t *) buf, len, 1))
+	return grub_errno;
+
+      seal_range (node, pos, len);
+      return GRUB_ERR_NONE;
+    }
+
+  /* linked files are never written, the chunks are copied on write */
+  while (len > 0)
+    {
+      grub_size_t off = pos & (GRUB_VFS_CHUNK_SIZE - 1);
+      grub_size_t n = GRUB_VFS_CHUNK_SIZE - off;
+      grub_uint8_t *chunk;
+
+      if (n > len)
+	n = len;
+
+      chunk = link_chunk_copy (node, pos >> GRUB_VFS_CHUNK_SHIFT);
+      if (!chunk)
+	return grub_errno;
+
+      grub_memcpy (chunk + off, buf, n);
+      pos += n;
+      buf += n;
+      len -= n;
+    }
+
+  return GRUB_ERR_NONE;
+}
+
 /* Close the file */
 void
 grub_vfs_close (struct grub_vfs_ctx *ctx)
 {
-  if (ctx->file)
-    grub_file_close (ctx->file);
-
+  /* the underlying file stays open with the node */
   grub_free (ctx);
 }
 
+grub_err_t
+grub_vfs_update_len (struct grub_vfs_node *node)
+{
+  grub_file_t file;
+
+  if (!node->path_to_file || node->file)
+    return GRUB_ERR_NONE;
+
+  /* only the size is wanted, don't pin the file until it is read */
+  file = grub_file_open (node->path_to_file, GRUB_FILE_TYPE_CAT);
+  if (!file)
+    {
+      grub_dprintf ("vfs", "unable to open the file `%s'\n",
+		    node->path_to_file);
+      return grub_errno ? grub_errno : GRUB_ERR_FILE_NOT_FOUND;
+    }
+
+  node->vfs->stats.file_opens++;
+  node->len = grub_file_size (file);
+  grub_file_close (file);
+
+  return GRUB_ERR_NONE;
+}
+
+grub_err_t
+grub_vfs_load (struct grub_vfs_node *node, grub_file_t file, grub_size_t len)
+{
+  grub_size_t pos = 0;
+
+  if (node->type != GRUB_VFS_NODE_TYPE_MEMORY_FILE)
+    return grub_error (GRUB_ERR_BAD_FILE_TYPE, N_ ("not a memory file"));
+
+  release_chunks (node, 0);
+  node->len = 0;
+
+  /* read straight into the chunks, there is no staging buffer */
+  while (pos < len)
+    {
+      grub_size_t n = len - pos;
+
+      if (n > GRUB_VFS_CHUNK_SIZE)
+	n = GRUB_VFS_CHUNK_SIZE;
+
+      /* a chunk is allocated only once the one before it is sealed */
+      if (reserve_chunks (node, pos + n))
+	goto fail;
+
+      if (grub_file_read (file, node->chunks[pos >> GRUB_VFS_CHUNK_SHIFT].data,
+			  n) != (grub_ssize_t) n)
+	{
+	  if (!grub_errno)
+	    grub_error (GRUB_ERR_FILE_READ_ERROR, N_ ("premature end of file"));
+	  goto fail;
+	}
+
+      /* seal as we go, so with compression on only one plain chunk is
+	 around at a time */
+      node->len = pos + n;
+      seal_chunk (node, pos >> GRUB_VFS_CHUNK_SHIFT);
+
+      pos += n;
+    }
+
+  node->len = len;
+
+  if (node->vfs->mapped == node)
+    grub_disk_cache_invalidate_all ();
+
+  return GRUB_ERR_NONE;
+
+fail:
+  release_chunks (node, 0);
+  node->len = 0;
+  return grub_errno;
+}
+
+grub_err_t
+grub_vfs_set_compress (struct grub_vfs *vfs, int compress)
+{
+  vfs->compress = compress;
+
+  /* shared chunks already compressed stay so until they are released */
+  if (compress)
+    seal_tree (vfs->root);
+
+  return GRUB_ERR_NONE;
+}
+
+void
+grub_vfs_set_cache (struct grub_vfs *vfs, grub_size_t nblocks)
+{
+  /* the caches are created again with the new size on the next read */
+  drop_caches (vfs->root);
+  vfs->cache_blocks = nblocks;
+}
+
 struct helper_data
 {
   grub_fs_dir_hook_t hook;
@@ -24,6 +24,7 @@
 #include <grub/lib/arg.h>
 #include <grub/extcmd.h>
 #include <grub/dl.h>
+#include <grub/file.h>
 #include "vfs.h"
 
 GRUB_MOD_LICENSE ("GPLv3+");
@@ -36,6 +37,12 @@ static const struct grub_arg_option options_vdiskctl[] =
   { "rm", 'r', 0, N_ ("remove the file from the virtual file system"), 0, 0 },
   { "mkdir", 'p', 0, N_ ("create an empty directory in the virtual file system"), 0, 0 },
   { "mkfile", 'f', 0, N_ ("create an empty file in the virtual file systemm"), 0, 0 },
+  { "map", 'm', 0, N_ ("map a file onto the disk device, or unmap it"), 0, 0 },
+  { "cache", 'k', 0, N_ ("set the read cache size of each linked file in KiB"), 0, 0 },
+  { "import", 'i', 0, N_ ("import a cpio or tar archive into the virtual file system"), 0, 0 },
+  { "compress", 'z', 0, N_ ("compress the memory files of the virtual file system"), 0, 0 },
+  { "stats", 's', 0, N_ ("show the counters of the virtual file system"), 0, 0 },
+  { "overlay", 'o', 0, N_ ("stack a directory over a real directory"), 0, 0 },
   { 0, 0, 0, 0, 0, 0 }
 };
 
@@ -47,6 +54,12 @@ enum options_vdiskctl
   VDISK_RM,
   VDISK_MKDIR,
   VDISK_MKFILE,
+  VDISK_MAP,
+  VDISK_CACHE,
+  VDISK_IMPORT,
+  VDISK_COMPRESS,
+  VDISK_STATS,
+  VDISK_OVERLAY,
 };
 
 /* Split the PATH into directory name DIRNAME and file name FILENAME
@@ -328,6 +341,227 @@ final:
   return grub_errno;
 }
 
+static grub_err_t
+grub_vdiskctl_map (int argc, char **args)
+{
+  struct grub_vfs *vfs;
+  struct grub_vfs_node *node = NULL;
+
+  if (argc != 1 && argc != 2)
+    return grub_error (GRUB_ERR_BAD_ARGUMENT, N_ ("invalid argument"));
+
+  const char *fs_name = args[0];
+
+  if (grub_vfs_get (fs_name, &vfs))
+    return grub_errno;
+
+  /* without a file, the device is unmapped */
+  if (argc == 2 && grub_vfshelper_lookup_node (vfs, args[1], &node,
+					       GRUB_VFSHELPER_FILE))
+    return grub_errno;
+
+  return grub_vfs_map (vfs, node);
+}
+
+static grub_err_t
+grub_vdiskctl_cache (int argc, char **args)
+{
+  struct grub_vfs *vfs;
+  const char *end;
+  unsigned long size;
+
+  if (argc != 2)
+    return grub_error (GRUB_ERR_BAD_ARGUMENT, N_ ("invalid argument"));
+
+  const char *fs_name = args[0];
+
+  if (grub_vfs_get (fs_name, &vfs))
+    return grub_errno;
+
+  size = grub_strtoul (args[1], &end, 0);
+  if (grub_errno || *end != '\0')
+    return grub_error (GRUB_ERR_BAD_NUMBER, N_ ("unrecognized number"));
+
+  /* the size in bytes, rounded up to whole blocks, must fit a grub_size_t */
+  if (size > (GRUB_SIZE_MAX - ((1 << GRUB_VFS_CACHE_BLOCK_SHIFT) - 1)) >> 10)
+    return grub_error (GRUB_ERR_OUT_OF_RANGE, N_ ("the cache is too large"));
+
+  grub_vfs_set_cache (vfs, ALIGN_UP (size << 10,
+				     1 << GRUB_VFS_CACHE_BLOCK_SHIFT)
+		      >> GRUB_VFS_CACHE_BLOCK_SHIFT);
+  return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+grub_vdiskctl_import (int argc, char **args)
+{
+  struct grub_vfs *vfs;
+  struct grub_vfs_node *node;
+  grub_file_t archive;
+
+  if (argc != 2 && argc != 3)
+    return grub_error (GRUB_ERR_BAD_ARGUMENT, N_ ("invalid argument"));
+
+  const char *fs_name = args[0];
+  const char *archive_name = args[1];
+  const char *dir_name = argc == 3 ? args[2] : "/";
+
+  if (grub_vfs_get (fs_name, &vfs))
+    return grub_errno;
+
+  if (grub_vfshelper_lookup_node (vfs, dir_name, &node, GRUB_VFSHELPER_DIR))
+    return grub_errno;
+
+  archive = grub_file_open (archive_name, GRUB_FILE_TYPE_CAT);
+  if (!archive)
+    return grub_errno;
+
+  grub_vfs_import (node, archive);
+  grub_file_close (archive);
+
+  return grub_errno;
+}
+
+static grub_err_t
+grub_vdiskctl_compress (int argc, char **args)
+{
+  struct grub_vfs *vfs;
+  int compress;
+
+  if (argc != 2)
+    return grub_error (GRUB_ERR_BAD_ARGUMENT, N_ ("invalid argument"));
+
+  const char *fs_name = args[0];
+
+  if (grub_strcmp (args[1], "on") == 0)
+    compress = 1;
+  else if (grub_strcmp (args[1], "off") == 0)
+    compress = 0;
+  else
+    return grub_error (GRUB_ERR_BAD_ARGUMENT, N_ ("expected `on' or `off'"));
+
+  if (grub_vfs_get (fs_name, &vfs))
+    return grub_errno;
+
+  return grub_vfs_set_compress (vfs, compress);
+}
+
+/* Print the counters of the files under DIR, PREFIX is the path of DIR */
+static grub_err_t
+print_node_stats (struct grub_vfs_node *dir, const char *prefix)
+{
+  struct grub_vfs_node *start = dir->children;
+  struct grub_vfs_node *current = start;
+
+  if (start == NULL)
+    return GRUB_ERR_NONE;
+
+  do
+    {
+      struct grub_vfs_node_stats *stats = &current->stats;
+      char *path = grub_xasprintf ("%s/%s", prefix, current->name);
+
+      if (!path)
+	return grub_errno;
+
+      if (current->type == GRUB_VFS_NODE_TYPE_DIRECTORY)
+	{
+	  if (print_node_stats (current, path))
+	    {
+	      grub_free (path);
+	      return grub_errno;
+	    }
+	}
+      else if (stats->reads || stats->writes)
+	grub_printf ("  %s: %llu reads (%llu bytes), %llu writes (%llu bytes)\n",
+		     path, (unsigned long long) stats->reads,
+		     (unsigned long long) stats->bytes_read,
+		     (unsigned long long) stats->writes,
+		     (unsigned long long) stats->bytes_written);
+
+      grub_free (path);
+      current = current->next;
+    }
+  while (current != start);
+
+  return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+grub_vdiskctl_stats (int argc, char **args)
+{
+  struct grub_vfs *vfs;
+  struct grub_vfs_stats *stats;
+  grub_uint64_t zhits, zmisses;
+  grub_size_t nblobs, store_size;
+
+  if (argc != 1)
+    return grub_error (GRUB_ERR_BAD_ARGUMENT, N_ ("invalid argument"));
+
+  const char *fs_name = args[0];
+
+  if (grub_vfs_get (fs_name, &vfs))
+    return grub_errno;
+
+  stats = &vfs->stats;
+  grub_vfs_zcache_stats (&zhits, &zmisses);
+  grub_vfs_store_stats (&nblobs, &store_size);
+
+  grub_printf ("lookups: %llu (%llu misses)\n",
+	       (unsigned long long) stats->lookups,
+	       (unsigned long long) stats->lookup_misses);
+  grub_printf ("reads: %llu (%llu bytes)\n",
+	       (unsigned long long) stats->reads,
+	       (unsigned long long) stats->bytes_read);
+  grub_printf ("writes: %llu (%llu bytes)\n",
+	       (unsigned long long) stats->writes,
+	       (unsigned long long) stats->bytes_written);
+  grub_printf ("reallocations: %llu\n",
+	       (unsigned long long) stats->reallocs);
+  grub_printf ("underlying file opens: %llu\n",
+	       (unsigned long long) stats->file_opens);
+  grub_printf ("read cache: %llu hits, %llu misses\n",
+	       (unsigned long long) stats->cache_hits,
+	       (unsigned long long) stats->cache_misses);
+  grub_printf ("shared chunks: %llu\n",
+	       (unsigned long long) stats->shared_chunks);
+  grub_printf ("memory: %llu bytes (peak %llu), arena: %llu bytes\n",
+	       (unsigned long long) stats->mem,
+	       (unsigned long long) stats->peak_mem,
+	       (unsigned long long) vfs->arena.size);
+
+  /* the store and the decompressed chunks are shared by all the vfs */
+  grub_printf ("store: %llu chunks (%llu bytes), "
+	       "decompression cache: %llu hits, %llu misses\n",
+	       (unsigned long long) nblobs, (unsigned long long) store_size,
+	       (unsigned long long) zhits, (unsigned long long) zmisses);
+
+  grub_printf ("files:\n");
+  return print_node_stats (vfs->root, "");
+}
+
+static grub_err_t
+grub_vdiskctl_overlay (int argc, char **args)
+{
+  struct grub_vfs *vfs;
+  struct grub_vfs_node *node;
+
+  if (argc != 3)
+    return grub_error (GRUB_ERR_BAD_ARGUMENT, N_ ("invalid argument"));
+
+  const char *fs_name = args[0];
+  const char *dir_name = args[1];
+  const char *lower_name = args[2];
+
+  if (grub_vfs_get (fs_name, &vfs))
+    return grub_errno;
+
+  if (grub_vfshelper_lookup_node (vfs, dir_name, &node, GRUB_VFSHELPER_DIR))
+    return grub_errno;
+
+  return grub_vfs_overlay (node, lower_name);
+}
+
 /*
  * options:
  *   -c --create  FS_NAME
@@ -336,6 +570,12 @@ final:
  *   -r --rm      FS_NAME PATH
  *   -p --mkdir   FS_NANE DIR
  *   -f --mkfile  FS_NAME FILE
+ *   -m --map     FS_NAME [FILE]
+ *   -k --cache   FS_NAME KIB
+ *   -i --import  FS_NAME ARCHIVE [DIR]
+ *   -z --compress FS_NAME on|off
+ *   -s --stats   FS_NAME
+ *   -o --overlay FS_NAME DIR LOWER_DIR
  */
 
 static grub_err_t
@@ -355,6 +595,18 @@ grub_vdiskctl (grub_extcmd_context_t ctxt, int argc, char **args)
     return grub_vdiskctl_mkdir (argc, args);
   if (state[VDISK_MKFILE].set)
     return grub_vdiskctl_mkfile (argc, args);
+  if (state[VDISK_MAP].set)
+    return grub_vdiskctl_map (argc, args);
+  if (state[VDISK_CACHE].set)
+    return grub_vdiskctl_cache (argc, args);
+  if (state[VDISK_IMPORT].set)
+    return grub_vdiskctl_import (argc, args);
+  if (state[VDISK_COMPRESS].set)
+    return grub_vdiskctl_compress (argc, args);
+  if (state[VDISK_STATS].set)
+    return grub_vdiskctl_stats (argc, args);
+  if (state[VDISK_OVERLAY].set)
+    return grub_vdiskctl_overlay (argc, args);
 
   return grub_error (GRUB_ERR_BAD_ARGUMENT, N_ ("unexpected arguments"));
 }
@@ -370,7 +622,13 @@ GRUB_MOD_INIT (vdisk)
         "-a --add     FS_NAME PATH FILE\n"
         "-r --rm      FS_NAME PATH\n"
         "-p --mkdir   FS_NANE DIR\n"
-        "-f --mkfile  FS_NAME FILE");
+        "-f --mkfile  FS_NAME FILE\n"
+        "-m --map     FS_NAME [FILE]\n"
+        "-k --cache   FS_NAME KIB\n"
+        "-i --import  FS_NAME ARCHIVE [DIR]\n"
+        "-z --compress FS_NAME on|off\n"
+        "-s --stats   FS_NAME\n"
+        "-o --overlay FS_NAME DIR LOWER_DIR");
 
   const char *desc = "Control the virtual file system";
   cmd = grub_register_extcmd ("vdisk", grub_vdiskctl, 0, hlpstr, desc, options_vdiskctl);
@@ -26,6 +26,10 @@
 #define VFS_DEVICE_NAME "vfs_"
 #define VFS_DEVICE_LEN sizeof(VFS_DEVICE_NAME)
 
+/* The device shares its id with loopback, whose disk ids count up from 0.
+   Ours count down from the top, so the disk cache never mixes the two up */
+#define VFS_DISK_ID(id) (~0UL - (id))
+
 struct vfsdev_iterate_data
 {
   void *orig_hook_data;
@@ -109,9 +113,15 @@ grub_vfsdev_open (const char *name, grub_disk_t disk)
   if (lookup_device (name, &vfs))
     return grub_errno;
 
-  disk->total_sectors = 0;
-  disk->id = 0;
-  disk->data = 0;
+  disk->id = VFS_DISK_ID (vfs->id);
+  disk->data = vfs;
+
+  /* Only a mapped file gives the device any sectors */
+  if (vfs->mapped)
+    disk->total_sectors = ALIGN_UP (vfs->mapped->len, GRUB_DISK_SECTOR_SIZE)
+      >> GRUB_DISK_SECTOR_BITS;
+  else
+    disk->total_sectors = 0;
 
   return GRUB_ERR_NONE;
 }
@@ -122,23 +132,23 @@ grub_vfsdev_close (grub_disk_t disk __attribute ((unused)))
 }
 
 static grub_err_t
-grub_vfsdev_read (grub_disk_t disk __attribute ((unused)),
-		  grub_disk_addr_t sector __attribute ((unused)),
-		  grub_size_t size __attribute ((unused)),
-		  char *buf __attribute ((unused)))
+grub_vfsdev_read (grub_disk_t disk, grub_disk_addr_t sector,
+		  grub_size_t size, char *buf)
 {
-  grub_errno = GRUB_ERR_OUT_OF_RANGE;
-  return GRUB_ERR_OUT_OF_RANGE;
+  struct grub_vfs *vfs = (struct grub_vfs *) disk->data;
+
+  return grub_vfs_map_read (vfs, sector << GRUB_DISK_SECTOR_BITS, buf,
+			    size << GRUB_DISK_SECTOR_BITS);
 }
 
 static grub_err_t
-grub_vfsdev_write (grub_disk_t disk __attribute ((unused)),
-		   grub_disk_addr_t sector __attribute ((unused)),
-		   grub_size_t size __attribute ((unused)),
-		   const char *buf __attribute ((unused)))
+grub_vfsdev_write (grub_disk_t disk, grub_disk_addr_t sector,
+		   grub_size_t size, const char *buf)
 {
-  grub_errno = GRUB_ERR_OUT_OF_RANGE;
-  return GRUB_ERR_OUT_OF_RANGE;
+  struct grub_vfs *vfs = (struct grub_vfs *) disk->data;
+
+  return grub_vfs_map_write (vfs, sector << GRUB_DISK_SECTOR_BITS, buf,
+			     size << GRUB_DISK_SECTOR_BITS);
 }
 
 /* File system */
@@ -147,9 +157,11 @@ grub_vfsfs_read (grub_file_t file, char *buf, grub_size_t len)
 {
   struct grub_vfs_ctx *ctx = (struct grub_vfs_ctx *) file->data;
 
-  grub_vfs_seek (ctx, file->offset);
+  if (ctx->cpio)
+    return grub_vfs_cpio_read (ctx->cpio, file->offset, buf, len);
 
-  return grub_vfs_read (ctx, buf, len);
+  /* the offset lives in FILE, the context is left alone */
+  return grub_vfs_pread (ctx->node, file->offset, buf, len);
 }
 
 static grub_err_t
@@ -157,11 +169,41 @@ grub_vfsfs_close (grub_file_t file)
 {
   struct grub_vfs_ctx *ctx = (struct grub_vfs_ctx *) file->data;
 
-  grub_vfs_close (ctx);
+  if (ctx->cpio)
+    {
+      grub_vfs_cpio_close (ctx->cpio);
+      grub_free (ctx);
+    }
+  else
+    grub_vfs_close (ctx);
 
   return GRUB_ERR_NONE;
 }
 
+/* Check whether PATH names the cpio archive of the vfs */
+static int
+is_cpio_path (const char *path)
+{
+  while (*path == '/')
+    path++;
+
+  return grub_strcasecmp (path, GRUB_VFS_CPIO_NAME) == 0;
+}
+
+/* Check whether the root of VFS has a real file called like the archive */
+static int
+is_real_cpio (struct grub_vfs *vfs)
+{
+  struct grub_vfs_node *node;
+  int found;
+
+  grub_error_push ();
+  found = grub_vfs_lookup (vfs->root, GRUB_VFS_CPIO_NAME, &node) == 0;
+  grub_error_pop ();
+
+  return found;
+}
+
 struct dir_helper_data
 {
   grub_fs_dir_hook_t hook;
@@ -199,7 +241,8 @@ grub_vfsfs_dir (grub_device_t device, const char *path,
   if (!dev)
     return grub_error (GRUB_ERR_BAD_DEVICE, N_ ("invalid device"));
 
-  if (lookup_device (dev->name, &vfs))
+  /* A mapped vfs is left to the file system of the mapped image */
+  if (lookup_device (dev->name, &vfs) || vfs->mapped)
     {
       return grub_error (GRUB_ERR_BAD_FS, N_ ("not a vfsfs"));
     }
@@ -207,6 +250,18 @@ grub_vfsfs_dir (grub_device_t device, const char *path,
   if (grub_vfshelper_lookup_node (vfs, path, &node, GRUB_VFSHELPER_DIR))
     return grub_errno;
 
+  /* the cpio archive of the vfs shows in the root directory */
+  if (node == vfs->root && !is_real_cpio (vfs))
+    {
+      struct grub_dirhook_info info =
+      {
+	.case_insensitive = 1
+      };
+
+      if (hook (GRUB_VFS_CPIO_NAME, &info, hook_data))
+	return GRUB_ERR_NONE;
+    }
+
   return grub_vfs_dir (node, dir_helper, &data);
 }
 
@@ -222,11 +277,33 @@ grub_vfsfs_open (struct grub_file *file, const char *path)
   if (!dev)
     return grub_error (GRUB_ERR_BAD_DEVICE, N_ ("invalid device"));
 
-  if (lookup_device (dev->name, &vfs))
+  /* A mapped vfs is left to the file system of the mapped image */
+  if (lookup_device (dev->name, &vfs) || vfs->mapped)
     {
       return grub_error (GRUB_ERR_BAD_FS, N_ ("not a vfsfs"));
     }
 
+  /* a real file of the same name takes precedence */
+  if (is_cpio_path (path) && !is_real_cpio (vfs))
+    {
+      ctx = grub_zalloc (sizeof (*ctx));
+      if (!ctx)
+	return grub_errno;
+
+      ctx->cpio = grub_vfs_cpio_open (vfs);
+      if (!ctx->cpio)
+	{
+	  grub_free (ctx);
+	  return grub_errno;
+	}
+
+      file->offset = 0;
+      file->data = ctx;
+      file->size = grub_vfs_cpio_size (ctx->cpio);
+
+      return GRUB_ERR_NONE;
+    }
+
   if (grub_vfshelper_lookup_node (vfs, path, &node, GRUB_VFSHELPER_FILE)) {
     grub_dprintf ("vfs", "file `%s' not found\n", path);
     return grub_errno;
@@ -282,4 +359,5 @@ void vdisk_fini (void)
 {
   grub_disk_dev_unregister (&grub_vfs_dev);
   grub_fs_unregister (&grub_vfs_fs);
+  grub_vfs_zcache_release ();
 }
@@ -38,14 +38,74 @@ enum {
   GRUB_VFS_NODE_TYPE_DIRECTORY
 };
 
+/* Memory files are stored in chunks of this size */
+#define GRUB_VFS_CHUNK_SHIFT 12
+#define GRUB_VFS_CHUNK_SIZE (1 << GRUB_VFS_CHUNK_SHIFT)
+
+/* Linked files are cached in blocks of this size */
+#define GRUB_VFS_CACHE_BLOCK_SHIFT 12
+
+struct grub_vfs_blob;
+
+/* A chunk of a memory file, private to the node or shared */
+struct grub_vfs_chunk {
+  /* The private contents, NULL if the chunk is shared */
+  grub_uint8_t *data;
+
+  /* The shared contents, in the store */
+  struct grub_vfs_blob *blob;
+};
+
 struct grub_vfs;
+struct grub_vfs_cache;
+struct grub_vfs_arena_block;
+struct grub_vfs_cpio;
+
+/* Counters of the activity of a vfs */
+struct grub_vfs_stats {
+  grub_uint64_t lookups;
+  grub_uint64_t lookup_misses;
+
+  grub_uint64_t reads;
+  grub_uint64_t bytes_read;
+  grub_uint64_t writes;
+  grub_uint64_t bytes_written;
+
+  /* Growths of the chunk and children indexes */
+  grub_uint64_t reallocs;
+
+  /* Opens of the underlying files of linked files */
+  grub_uint64_t file_opens;
+
+  /* Blocks found in, and read into, the caches of linked files */
+  grub_uint64_t cache_hits;
+  grub_uint64_t cache_misses;
+
+  /* Full chunks found in the store when they were shared */
+  grub_uint64_t shared_chunks;
+
+  /* Memory held in private chunks and indexes, and its peak */
+  grub_size_t mem;
+  grub_size_t peak_mem;
+};
+
+/* Counters of the activity of a file */
+struct grub_vfs_node_stats {
+  grub_uint64_t reads;
+  grub_uint64_t bytes_read;
+  grub_uint64_t writes;
+  grub_uint64_t bytes_written;
+};
+
+/* The name of the cpio archive of the whole vfs, in the root directory */
+#define GRUB_VFS_CPIO_NAME ".cpio"
 
 /*
  * Always modify this structure using the provided functions.
  */
 struct grub_vfs_node {
-  /* File or directory name */
-  char *name;
+  /* File or directory name, interned in the arena of the vfs */
+  const char *name;
 
   /* The type of the file */
   int type;
@@ -53,10 +113,26 @@ struct grub_vfs_node {
   /* If the type of the file is 0,
    * This variable contains the absolute path to the underlying file.
    */
-  char *path_to_file;
+  const char *path_to_file;
 
-  /* Point to the underlying data */
-  grub_uint8_t *data;
+  /* Point to the underlying data, GRUB_VFS_CHUNK_SIZE bytes per chunk */
+  struct grub_vfs_chunk *chunks;
+  grub_size_t nchunks;
+
+  /* The number of allocated entries in CHUNKS */
+  grub_size_t chunks_size;
+
+  /* The real directory under an overlay directory, NULL if there is none.
+   * Its entries are merged into CHILDREN the first time they are needed.
+   */
+  const char *lower;
+  int lower_merged;
+
+  /* The underlying file of a linked file, kept open across opens */
+  grub_file_t file;
+
+  /* The read cache of a linked file */
+  struct grub_vfs_cache *cache;
 
   /* The length of the file */
   grub_size_t len;
@@ -73,6 +149,34 @@ struct grub_vfs_node {
 
   /* the vfs which this node belonged to */
   struct grub_vfs *vfs;
+
+  /* hash of the case-folded name, used by the index of the parent */
+  grub_uint32_t hash;
+
+  /* open addressing index of the children nodes, for directories */
+  struct grub_vfs_node **index;
+  grub_size_t index_size;
+  grub_size_t nchildren;
+
+  struct grub_vfs_node_stats stats;
+};
+
+/* The nodes and names of a vfs live in its arena, and are released
+   together with it. */
+struct grub_vfs_arena {
+  /* Memory blocks, the first one is being carved */
+  struct grub_vfs_arena_block *blocks;
+
+  /* Nodes freed before the vfs */
+  void *free_nodes;
+
+  /* Open addressing table of the interned names */
+  const char **names;
+  grub_size_t names_size;
+  grub_size_t nnames;
+
+  /* The size of all the blocks */
+  grub_size_t size;
 };
 
 struct grub_vfs {
@@ -82,6 +186,23 @@ struct grub_vfs {
   /* The root directory */
   struct grub_vfs_node *root;
 
+  /* Unique id of the disk device, used by the disk cache */
+  unsigned long id;
+
+  /* The file node mapped onto the disk device, if any */
+  struct grub_vfs_node *mapped;
+
+  /* The number of cache blocks of each linked file, 0 to disable */
+  grub_size_t cache_blocks;
+
+  /* Whether the full chunks of memory files are compressed */
+  int compress;
+
+  /* The memory of the nodes */
+  struct grub_vfs_arena arena;
+
+  struct grub_vfs_stats stats;
+
   /* linked list to other vfs */
   struct grub_vfs *next;
   struct grub_vfs *prev;
@@ -91,11 +212,14 @@ struct grub_vfs_ctx {
   /* The node */
   struct grub_vfs_node *node;
 
-  /* The underlying file */
+  /* The underlying file, shared by all the contexts of the node */
   grub_file_t file;
 
   /* position */
   grub_off_t pos;
+
+  /* The cpio archive of the vfs, if this is GRUB_VFS_CPIO_NAME */
+  struct grub_vfs_cpio *cpio;
 };
 
 typedef int (*grub_vfs_iterate_fs_hook_func_t) (struct grub_vfs * vfs,
@@ -154,6 +278,9 @@ grub_vfs_open (struct grub_vfs_node *node);
 /* Close the file */
 void grub_vfs_close (struct grub_vfs_ctx *ctx);
 
+/* Bring the length of NODE up to date, without keeping a linked file open */
+grub_err_t grub_vfs_update_len (struct grub_vfs_node *node);
+
 /* Seek the file */
 grub_off_t grub_vfs_seek (struct grub_vfs_ctx *ctx, grub_off_t pos);
 
@@ -161,6 +288,11 @@ grub_off_t grub_vfs_seek (struct grub_vfs_ctx *ctx, grub_off_t pos);
 grub_ssize_t
 grub_vfs_read (struct grub_vfs_ctx *ctx, char *buf, grub_size_t len);
 
+/* read LEN bytes of NODE at POS, without a context */
+grub_ssize_t
+grub_vfs_pread (struct grub_vfs_node *node, grub_off_t pos, char *buf,
+		grub_size_t len);
+
 /* write the file */
 grub_ssize_t
 grub_vfs_write (struct grub_vfs_ctx *ctx, char *buf, grub_size_t len);
@@ -168,6 +300,113 @@ grub_vfs_write (struct grub_vfs_ctx *ctx, char *buf, grub_size_t len);
 /* truncate the file to LEN */
 grub_err_t grub_vfs_trunc (struct grub_vfs_ctx * ctx, grub_size_t len);
 
+/* Map the file NODE onto the disk device of VFS, or unmap it if NULL */
+grub_err_t grub_vfs_map (struct grub_vfs *vfs, struct grub_vfs_node *node);
+
+/* Read LEN bytes at POS from the mapped node of VFS */
+grub_err_t
+grub_vfs_map_read (struct grub_vfs *vfs, grub_off_t pos, char *buf,
+		   grub_size_t len);
+
+/* Write LEN bytes at POS to the mapped node of VFS */
+grub_err_t
+grub_vfs_map_write (struct grub_vfs *vfs, grub_off_t pos, const char *buf,
+		    grub_size_t len);
+
+/* Replace the contents of the memory file NODE with LEN bytes of FILE */
+grub_err_t
+grub_vfs_load (struct grub_vfs_node *node, grub_file_t file, grub_size_t len);
+
+/* Turn the compression of the memory files in VFS on or off */
+grub_err_t grub_vfs_set_compress (struct grub_vfs *vfs, int compress);
+
+/* Set the number of cache blocks of the linked files in VFS */
+void grub_vfs_set_cache (struct grub_vfs *vfs, grub_size_t nblocks);
+
+/* cache.c */
+struct grub_vfs_cache *grub_vfs_cache_new (grub_size_t nblocks);
+
+void grub_vfs_cache_free (struct grub_vfs_cache *cache);
+
+grub_ssize_t
+grub_vfs_cache_read (struct grub_vfs_cache *cache, grub_file_t file,
+		     grub_off_t pos, char *buf, grub_size_t len,
+		     struct grub_vfs_stats *stats);
+
+/* import.c */
+grub_err_t grub_vfs_import (struct grub_vfs_node *dir, grub_file_t archive);
+
+/* arena.c */
+void *grub_vfs_arena_alloc (struct grub_vfs_arena *arena, grub_size_t size);
+
+struct grub_vfs_node *grub_vfs_arena_node (struct grub_vfs_arena *arena);
+
+void
+grub_vfs_arena_free_node (struct grub_vfs_arena *arena,
+			  struct grub_vfs_node *node);
+
+const char *
+grub_vfs_arena_intern (struct grub_vfs_arena *arena, const char *name);
+
+void grub_vfs_arena_release (struct grub_vfs_arena *arena);
+
+/* compress.c */
+grub_size_t
+grub_vfs_compress (const grub_uint8_t *src, grub_size_t len,
+		   grub_uint8_t *dst, grub_size_t cap);
+
+grub_err_t
+grub_vfs_decompress (const grub_uint8_t *src, grub_size_t len,
+		     grub_uint8_t *dst, grub_size_t size);
+
+/* Get the decompressed contents of a compressed chunk */
+const grub_uint8_t *
+grub_vfs_zcache_get (const grub_uint8_t *cdata, grub_size_t csize);
+
+/* Forget the compressed chunk CDATA, before it is freed */
+void grub_vfs_zcache_forget (const grub_uint8_t *cdata);
+
+void grub_vfs_zcache_release (void);
+
+void grub_vfs_zcache_stats (grub_uint64_t *hits, grub_uint64_t *misses);
+
+/* store.c */
+
+/* Share the full chunk DATA, which is taken over unless NULL is returned */
+struct grub_vfs_blob *
+grub_vfs_store_intern (grub_uint8_t *data, int compress);
+
+/* Get the plain contents of BLOB */
+const grub_uint8_t *grub_vfs_store_data (struct grub_vfs_blob *blob);
+
+void grub_vfs_store_compress (struct grub_vfs_blob *blob);
+
+/* Drop a reference to BLOB */
+void grub_vfs_store_put (struct grub_vfs_blob *blob);
+
+grub_uint32_t grub_vfs_store_refcount (struct grub_vfs_blob *blob);
+
+/* The number of blobs in the store and the memory of their data */
+void grub_vfs_store_stats (grub_size_t *nblobs, grub_size_t *size);
+
+/* Stack the directory NODE over the real directory LOWER */
+grub_err_t grub_vfs_overlay (struct grub_vfs_node *node, const char *lower);
+
+/* overlay.c */
+grub_err_t
+grub_vfs_lower_dir (const char *dir, grub_fs_dir_hook_t hook, void *hook_data);
+
+/* export.c */
+struct grub_vfs_cpio *grub_vfs_cpio_open (struct grub_vfs *vfs);
+
+grub_off_t grub_vfs_cpio_size (struct grub_vfs_cpio *cpio);
+
+grub_ssize_t
+grub_vfs_cpio_read (struct grub_vfs_cpio *cpio, grub_off_t pos, char *buf,
+		    grub_size_t len);
+
+void grub_vfs_cpio_close (struct grub_vfs_cpio *cpio);
+
 grub_err_t
 grub_vfshelper_lookup_node (struct grub_vfs *vfs, const char *path,
 			    struct grub_vfs_node **found, int expecttype);